@@ -19,6 +19,13 @@ repl:
 				um_global_symbol_capacity
 				    = (unsigned long)atol(argv[++i]);
 				continue;
+			} else if (!strcmp(argv[i] + 1, "stack")) {
+				um_vm_set_stack_limit(
+				    (unsigned long)atol(argv[++i]));
+				continue;
+			} else if (!strcmp(argv[i] + 1, "pause")) {
+				um_gc_set_pause_budget(atof(argv[++i]));
+				continue;
 			} else if (!strcmp(argv[i] + 1, "v")) {
 				fprintf(stdout,
 					"um: we don't track versions.\n");
@@ -24,6 +24,7 @@ SOFTWARE. */
 #define um_H
 
 #include <ctype.h>
+#include <errno.h>
 #include <math.h>
 #include <stdbool.h>
 #include <stddef.h>
@@ -33,6 +34,18 @@ SOFTWARE. */
 #include <string.h>
 #include <time.h>
 
+/* Hot functions are compiled to machine code on x86-64 Linux */
+#if defined(__x86_64__) && defined(__linux__) && !defined(UM_NO_JIT)
+#define UM_JIT
+#include <sys/mman.h>
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS 0x20
+#endif
+#ifndef UM_JIT_THRESHOLD
+#define UM_JIT_THRESHOLD 1000
+#endif
+#endif
+
 #define _REPL_PROMPT "> "
 
 typedef enum {
@@ -51,7 +64,10 @@ typedef enum {
 	table_t,
 	error_t,
 	type_t,
-	bool_t
+	bool_t,
+	integer_t,
+	code_t,
+	unbound_t
 } um_NounType;
 
 typedef enum {
@@ -63,7 +79,9 @@ typedef enum {
 	ERROR_FILE,
 	ERROR_USER,
 	ERROR_NOMUT,
-	ERROR_COERCION_FAIL
+	ERROR_COERCION_FAIL,
+	ERROR_STACK,
+	ERROR_MEMORY
 } um_ErrorCode;
 
 typedef struct {
@@ -79,7 +97,9 @@ static const char* error_string[] = {"",
 				     "File error",
 				     "",
 				     "Cannot mutate constant",
-				     "Coercion error"};
+				     "Coercion error",
+				     "Stack overflow",
+				     "Out of memory"};
 
 typedef struct um_Noun um_Noun;
 typedef struct um_Vector um_Vector;
@@ -87,6 +107,10 @@ typedef struct um_Vector um_Vector;
 typedef um_Error (*um_Builtin)(struct um_Vector* v_params,
 			       struct um_Noun* result);
 
+/* Every member of the union is a single word so a noun fits in two, and a pair
+ * in four; error values only carry their code. Nouns are not NaN-boxed into a
+ * single word: embedders and builtins read and write type, mut and value
+ * directly, and integers use all 64 bits of theirs */
 struct um_Noun {
 	um_NounType type;
 	bool mut;
@@ -94,8 +118,9 @@ struct um_Noun {
 		um_NounType type_v;
 		bool bool_v;
 		char character;
-		um_Error error_v;
+		um_ErrorCode error_v;
 		double number;
+		int64_t integer;
 		struct um_Pair* pair;
 		char* symbol;
 		struct um_String* string;
@@ -103,7 +128,7 @@ struct um_Noun {
 		um_Builtin builtin;
 		um_Vector* vector_v;
 		struct um_Table* table;
-		um_Error err_v;
+		struct um_Code* code;
 	} value;
 };
 
@@ -117,8 +142,6 @@ typedef struct um_Result um_Result;
 
 struct um_Pair {
 	struct um_Noun car, cdr;
-	char mark;
-	struct um_Pair* next;
 };
 typedef struct um_Pair um_Pair;
 
@@ -132,8 +155,6 @@ struct um_Table {
 	size_t capacity;
 	size_t size;
 	um_TableEntry** data;
-	char mark;
-	struct um_Table* next;
 };
 typedef struct um_Table um_Table;
 
@@ -145,36 +166,233 @@ struct um_Vector {
 
 struct um_String {
 	char* value;
-	char mark;
-	struct um_String* next;
 };
 
+/* Expressions are compiled to bytecode before they are run. Instructions are
+ * an opcode followed by a single operand, usually an index into constants or
+ * a jump target */
+typedef enum {
+	OP_CONST,
+	OP_LOCAL,
+	OP_ENV,
+	OP_GLOBAL,
+	OP_CELL,
+	OP_CHECK,
+	OP_POP,
+	OP_PICK,
+	OP_SWITCH,
+	OP_JUMP,
+	OP_JUMP_FALSE,
+	OP_CALL,
+	OP_TAIL_CALL,
+	OP_RETURN,
+	OP_CLOSURE,
+	OP_STORE_LOCAL,
+	OP_STORE_ENV,
+	OP_STORE_GLOBAL,
+	OP_FAIL
+} um_Opcode;
+
+/* Variables are resolved when compiled. A function's parameters and whatever
+ * it defs are its locals, each given a slot in its frame; OP_LOCAL reads one
+ * of the running function's slots and OP_ENV one of an enclosing function's,
+ * its operand being depth << 16 | slot. Anything else is looked up by name in
+ * the global environment, OP_GLOBAL caching the binding it finds in cells,
+ * and OP_CELL loads a binding of a namespace found when compiling. OP_CHECK
+ * pushes whether the global named by constant x still holds constant x + 1,
+ * the builtin code compiled from it relied on. Stores
+ * carry one of these in their top byte, BIND_LET overwriting its slot
+ * whatever it held */
+typedef enum {
+	BIND_DEF,
+	BIND_SET,
+	BIND_CONST,
+	BIND_DEFUN,
+	BIND_MAC,
+	BIND_LET
+} um_BindKind;
+
+/* A compiled function body, or a top level expression when args and body are
+ * nil. max_stack is how many values it may push onto the VM stack at most.
+ * cells holds a table entry for some constants, globals being the table of
+ * the environment they were found in.
+ * locals names each slot, the first params of which are the parameters when
+ * simple is set, that is when args is a plain list of distinct names, and
+ * those of lets no longer in scope being named sym_out_of_scope. A
+ * function making closures keeps its slots in a heap frame for them to
+ * capture, any other on the VM stack.
+ * With the JIT, calls counts how often the function was entered and jit holds
+ * its machine code once it is hot, jit_map giving where each op starts in it */
+struct um_Code {
+	int32_t* ops;
+	size_t size, capacity;
+	struct um_Noun* constants;
+	size_t constants_size, constants_capacity;
+	struct um_Noun args, body;
+	size_t max_stack;
+	struct um_Noun* locals;
+	size_t locals_size, params;
+	bool simple, heap;
+	struct um_TableEntry** cells;
+	struct um_Noun globals;
+#ifdef UM_JIT
+	size_t calls, jit_size;
+	unsigned char* jit;
+	uint32_t* jit_map;
+#endif
+};
+typedef struct um_Code um_Code;
+
+/* Heap objects are carved out of UM_PAGE_SIZE pages, aligned to their size so
+ * an object's page is found by masking its address. Alongside the objects each
+ * page keeps bitmaps of which slots are in use, marked, old, and remembered,
+ * so the collector never has to write to the objects themselves */
+#define UM_PAGE_SIZE (1 << 16)
+
+typedef enum {
+	HEAP_PAIR,
+	HEAP_STRING,
+	HEAP_TABLE,
+	HEAP_CODE,
+	HEAP_VECTOR,
+	HEAP_KINDS
+} um_HeapKind;
+
+struct um_Page {
+	struct um_Page* next;
+	um_HeapKind kind;
+	size_t count, bump, limit, words;
+	bool swept;
+	uint64_t *used, *mark, *old, *remembered;
+	char* data;
+	uint64_t bits[];
+};
+typedef struct um_Page um_Page;
+
+/* Dead slots are threaded onto free through their first word. After a full
+ * collection every page awaits a sweep, sweep points at the link to the next
+ * one and pages are swept lazily as the allocator runs out of free slots. Only
+ * slots below the page's limit, its bump mark at the time of the collection,
+ * are looked at so objects bumped since are left alone */
+struct um_Heap {
+	size_t size;
+	um_Page* pages;
+	um_Page** sweep;
+	void* free;
+};
+typedef struct um_Heap um_Heap;
+
 static const um_Noun nil
     = {.type = nil_t, .mut = false, .value = {.type_v = nil_t}};
 
 static const um_Noun um_noreturn
     = {.type = noreturn_t, .mut = false, .value = {.type_v = noreturn_t}};
 
+/* Fills the slots of locals not yet defined */
+static const um_Noun um_unbound
+    = {.type = unbound_t, .mut = false, .value = {.type_v = unbound_t}};
+
 um_Noun sym_quote, sym_const, sym_quasiquote, sym_unquote, sym_unquote_splicing,
     sym_def, sym_set, sym_defun, sym_fn, sym_if, sym_cond, sym_switch,
     sym_match, sym_mac, sym_apply, sym_cons, sym_string, sym_num, sym_char,
-    sym_do, sym_true, sym_false,
+    sym_do, sym_true, sym_false, sym_append, sym_let, sym_let_star,
+    sym_letrec, sym_out_of_scope, sym_while, sym_dotimes,
 
     sym_nil_t, sym_pair_t, sym_noun_t, sym_f64_t, sym_builtin_t, sym_closure_t,
     sym_macro_t, sym_string_t, sym_vector_t, sym_input_t, sym_output_t,
-    sym_error_t, sym_type_t, sym_bool_t;
+    sym_error_t, sym_type_t, sym_bool_t, sym_integer_t;
 
 um_Noun env;
 static size_t stack_capacity = 0;
 static size_t stack_size = 0;
 static um_Noun* stack = NULL;
-static um_Pair* pair_head = NULL;
-static struct um_String* str_head = NULL;
-static um_Table* table_head = NULL;
+static um_Heap heaps[HEAP_KINDS] = {
+    {sizeof(um_Pair), NULL, NULL, NULL},
+    {sizeof(struct um_String), NULL, NULL, NULL},
+    {sizeof(um_Table), NULL, NULL, NULL},
+    {sizeof(um_Code), NULL, NULL, NULL},
+    {sizeof(um_Vector), NULL, NULL, NULL}};
 static size_t alloc_count = 0;
 static size_t alloc_count_old = 0;
+
+/* Objects allocated since the last collection are young and logged in the
+ * nursery, old objects written to with a young value are logged in the
+ * remembered set; a minor collection only traces from these and the roots */
+#define UM_GC_NURSERY 8192
+static um_Noun* nursery = NULL;
+static size_t nursery_size = 0;
+static size_t nursery_capacity = 0;
+static um_Noun* remembered = NULL;
+static size_t remembered_size = 0;
+static size_t remembered_capacity = 0;
+static bool gc_minor = false;
+
+/* With a pause budget set, full collections mark incrementally: roots are
+ * shaded grey when the cycle starts and the grey stack is drained a slice at a
+ * time from garbage_collector_consider. New objects are allocated black and
+ * the write barrier shades whatever value it overwrites, so everything
+ * reachable at the start of the cycle survives it */
+typedef enum { GC_IDLE, GC_MARK } um_GCPhase;
+static um_GCPhase gc_phase = GC_IDLE;
+static double gc_pause_budget = 0;
+#define UM_GC_GREY_MAX (1 << 20)
+static um_Noun* gc_grey = NULL;
+static size_t gc_grey_size = 0;
+static size_t gc_grey_capacity = 0;
+static bool gc_grey_overflow = false;
+
+/* The VM keeps its operands on a fixed stack, so builtins can be handed their
+ * arguments in place, and its call frames in a growable array. Both are roots
+ * for the collector. A frame's slots start at base, just above the function
+ * called, unless they live in the heap frame env, a vector holding the
+ * enclosing env, the code and then the slots. Functions with their slots on
+ * the stack have the enclosing env as their env instead.
+ *
+ * Calls between closures never recurse in C, so how deep a program may
+ * recurse is set by vm_stack_limit, in values, rather than by the C stack.
+ * The whole stack is reserved up front but its pages are only touched as
+ * calls go deeper, and every frame holds at least its function so the frames
+ * are bounded too */
+#define UM_VM_STACK (1 << 22)
+typedef struct {
+	um_Noun code, env;
+	um_Noun* slots;
+	size_t pc, base;
+} um_Frame;
+static um_Noun* vm_stack = NULL;
+static size_t vm_stack_limit = UM_VM_STACK;
+static size_t vm_sp = 0;
+static um_Frame* vm_frames = NULL;
+static size_t vm_frames_size = 0;
+static size_t vm_frames_capacity = 0;
+
+/* What still recurses in C, the reader, macro expansion, the compiler and
+ * builtins calling back into the VM, counts its depth in um_nest and fails
+ * with ERROR_STACK past UM_NEST_MAX instead of overflowing the C stack */
+#define UM_NEST_MAX 4096
+static size_t um_nest = 0;
+
+/* Expansions are remembered by the identity of the form expanded, which Um
+ * code has no way to change, in a direct mapped cache whose entries are
+ * roots. Binding or replacing a macro in the environment bumps macex_epoch,
+ * which is all it takes to forget them. Macros may call functions and read
+ * other bindings too, so once an expansion has run one, replacing any binding
+ * bumps it as well. What a macro reads out of pairs, vectors and tables is
+ * not followed: changing those in place needs the mac evaluated again */
+#define UM_MACEX_CACHE 4096
+typedef struct {
+	um_Noun form, expansion;
+	size_t epoch;
+} um_MacexEntry;
+static um_MacexEntry* macex_cache = NULL;
+static size_t macex_epoch = 1;
+static bool macex_ran = false;
+
+/* Interned symbols live in an open addressed hash table, symbol_capacity is
+ * always a power of two and kept at least twice symbol_size */
 char** symbol_table;
 size_t symbol_size;
+size_t symbol_capacity;
 size_t um_global_symbol_capacity;
 um_Noun cur_expr;
 
@@ -184,6 +402,11 @@ um_Noun cur_expr;
 #define cdr2(p)	    	(cdr(p))
 #define pop(n)	    	(n = cdr2(n))
 #define isnil(n)	((n).type == nil_t || (n).type == noreturn_t)
+#define isnumber(n)	((n).type == real_t || (n).type == integer_t)
+
+#define bit_get(w, i)	(((w)[(i) >> 6] >> ((i) & 63)) & 1)
+#define bit_set(w, i)	((w)[(i) >> 6] |= (uint64_t)1 << ((i) & 63))
+#define bit_clear(w, i)	((w)[(i) >> 6] &= ~((uint64_t)1 << ((i) & 63)))
 
 #define ingest(s) do { um_Result _0 = um_interpret_string(s); \
 	if (_0.error._) { um_print_error(_0.error); }} while (0)
@@ -194,15 +417,16 @@ um_Noun cur_expr;
 	bool: new_bool,      	\
 	char*: new_string,   	\
 	double: new_number,  	\
+	int64_t: new_integer,	\
 	um_Builtin: new_builtin,\
 	um_NounType: new_type  	\
 )(T)
 
-inline um_Noun new_number(double x) { return (um_Noun){real_t, true, {.number = x}}; }
-inline um_Noun new_builtin(um_Builtin fn) { return (um_Noun){builtin_t, true, {.builtin = fn}}; }
-inline um_Noun new_type(um_NounType t) { return (um_Noun){type_t, true, {.type_v = t}}; }
-inline um_Noun new_bool(bool b) { return (um_Noun){bool_t, true, {.bool_v = b}}; }
-inline um_Noun new_vector(um_Vector* v) { return (um_Noun){vector_t, true, {.vector_v = v}};}
+static inline um_Noun new_number(double x) { return (um_Noun){real_t, true, {.number = x}}; }
+static inline um_Noun new_integer(int64_t x) { return (um_Noun){integer_t, true, {.integer = x}}; }
+static inline um_Noun new_builtin(um_Builtin fn) { return (um_Noun){builtin_t, true, {.builtin = fn}}; }
+static inline um_Noun new_type(um_NounType t) { return (um_Noun){type_t, true, {.type_v = t}}; }
+static inline um_Noun new_bool(bool b) { return (um_Noun){bool_t, true, {.bool_v = b}}; }
 /* clang-format on */
 
 /*
@@ -211,10 +435,13 @@ inline um_Noun new_vector(um_Vector* v) { return (um_Noun){vector_t, true, {.vec
 um_Noun cons(um_Noun car_val, um_Noun cdr_val);
 um_Noun intern(const char* buf);
 um_Noun new_string(char* x);
+char* copy_string(const char* x);
 
 void stack_add(um_Noun a);
+void vector_free(um_Vector* a);
 
 um_Noun real_to_t(double x, um_NounType t);
+um_Noun integer_to_t(int64_t x, um_NounType t);
 um_Noun noun_to_t(char* x, um_NounType t);
 um_Noun string_to_t(char* x, um_NounType t);
 um_Noun bool_to_t(bool x, um_NounType t);
@@ -222,28 +449,79 @@ um_Noun type_to_t(um_NounType x, um_NounType t);
 um_Noun nil_to_t(um_Noun x __attribute__((unused)), um_NounType t);
 
 bool listp(um_Noun expr);
+bool um_truthy(um_Noun a);
 um_Noun reverse_list(um_Noun list);
 
 um_Error macex_eval(um_Noun expr, um_Noun* result);
+um_Error macex_form(um_Noun expr, um_Noun* result);
 um_Error eval_expr(um_Noun expr, um_Noun env, um_Noun* result);
+um_Noun compile(um_Noun expr);
+um_Error vm_execute(um_Noun code, um_Noun env, um_Noun* result);
+um_Error vm_apply(um_Noun fn, um_Vector* v_params, um_Noun* result);
+um_Error builtin_apply(um_Vector* v_params, um_Noun* result);
+um_Error builtin_add(um_Vector* v_params, um_Noun* result);
+um_Error builtin_subtract(um_Vector* v_params, um_Noun* result);
+um_Error builtin_multiply(um_Vector* v_params, um_Noun* result);
+um_Error builtin_less(um_Vector* v_params, um_Noun* result);
+um_Error builtin_greater(um_Vector* v_params, um_Noun* result);
+um_Error builtin_eq(um_Vector* v_params, um_Noun* result);
+um_Error builtin_divide(um_Vector* v_params, um_Noun* result);
+um_Error builtin_modulo(um_Vector* v_params, um_Noun* result);
+um_Error builtin_eq_l(um_Vector* v_params, um_Noun* result);
+um_Error builtin_not(um_Vector* v_params, um_Noun* result);
+um_Error builtin_and(um_Vector* v_params, um_Noun* result);
+um_Error builtin_pow(um_Vector* v_params, um_Noun* result);
+um_Error builtin_cbrt(um_Vector* v_params, um_Noun* result);
+um_Error builtin_sin(um_Vector* v_params, um_Noun* result);
+um_Error builtin_cos(um_Vector* v_params, um_Noun* result);
+um_Error builtin_tan(um_Vector* v_params, um_Noun* result);
+um_Error builtin_asin(um_Vector* v_params, um_Noun* result);
+um_Error builtin_acos(um_Vector* v_params, um_Noun* result);
+um_Error builtin_atan(um_Vector* v_params, um_Noun* result);
+um_Error builtin_ceil(um_Vector* v_params, um_Noun* result);
+um_Error builtin_floor(um_Vector* v_params, um_Noun* result);
+um_Error builtin_float(um_Vector* v_params, um_Noun* result);
+um_Error builtin_integer(um_Vector* v_params, um_Noun* result);
+um_Error builtin_len(um_Vector* v_params, um_Noun* result);
+um_Error builtin_type(um_Vector* v_params, um_Noun* result);
+um_Error builtin_pairp(um_Vector* v_params, um_Noun* result);
+um_Error builtin_string(um_Vector* v_params, um_Noun* result);
+um_Error builtin_sum(um_Vector* v_params, um_Noun* result);
+um_Error builtin_product(um_Vector* v_params, um_Noun* result);
+um_Error builtin_dot(um_Vector* v_params, um_Noun* result);
+um_Error builtin_min(um_Vector* v_params, um_Noun* result);
+um_Error builtin_max(um_Vector* v_params, um_Noun* result);
+#ifdef UM_JIT
+void jit_compile(um_Code* code);
+#endif
 
 um_Noun env_create(um_Noun parent, size_t capacity);
-um_Error env_bind(um_Noun env, um_Noun arg_names, um_Vector* v_params);
 um_Error env_assign(um_Noun env, char* symbol, um_Noun value);
 um_Error env_get(um_Noun env, char* symbol, um_Noun* result);
 
 um_Noun new_table(size_t capacity);
+um_TableEntry* table_get(um_Table* tbl, um_Noun k);
 um_TableEntry* table_get_sym(um_Table* tbl, char* k);
+void table_add(um_Table* tbl, um_Noun k, um_Noun v);
 um_Error table_set_sym(um_Table* tbl, char* k, um_Noun v);
 
 void garbage_collector_consider();
-void garbage_collector_tag(um_Noun root);
+void garbage_collector_shade(um_Noun a);
+void garbage_collector_blacken(um_Noun a);
+void garbage_collector_drain();
+void garbage_collector_log(um_Noun** log,
+			   size_t* size,
+			   size_t* capacity,
+			   um_Noun a);
+void garbage_collector_young(um_Noun a);
+void garbage_collector_barrier(um_Noun owner, um_Noun old, um_Noun value);
 
 void um_print_expr(um_Noun a);
 void um_print_error(um_Error e);
 void um_print_result(um_Result r);
 
 size_t hash_code_sym(char* s);
+size_t hash_code_nested(um_Noun a, size_t depth);
 
 char* um_new_string();
 char* to_string(um_Noun a, bool write);
@@ -253,31 +531,213 @@ bool eq_l(um_Noun a, um_Noun b);
 bool eq_h(um_Noun a, um_Noun b);
 bool eq_pair_l(um_Noun a, um_Noun b);
 bool eq_pair_h(um_Noun a, um_Noun b);
+bool eq_atom_h(um_Noun a, um_Noun b);
 
 char* readline_fp(char* prompt, FILE* fp);
 um_Error read_expr(const char* input, const char** end, um_Noun* result);
+um_Error read_form(const char* input, const char** end, um_Noun* result);
+
+um_Page* heap_page_new(um_HeapKind kind) {
+	um_Heap* h = &heaps[kind];
+	um_Page* page = (um_Page*)aligned_alloc(UM_PAGE_SIZE, UM_PAGE_SIZE);
+	size_t count, words;
+
+	if (!page) { return NULL; }
+
+	/* Fit as many slots as possible alongside their four bitmaps */
+	count = (UM_PAGE_SIZE - sizeof(um_Page) - 16) * 8 / (h->size * 8 + 4);
+	for (;; count--) {
+		words = (count + 63) / 64;
+		if (sizeof(um_Page) + words * 4 * sizeof(uint64_t) + 16
+			+ count * h->size
+		    <= UM_PAGE_SIZE) {
+			break;
+		}
+	}
+
+	memset(page->bits, 0, words * 4 * sizeof(uint64_t));
+	page->kind = kind;
+	page->count = count;
+	page->bump = 0;
+	page->limit = 0;
+	page->swept = true;
+	page->words = words;
+	page->used = page->bits;
+	page->mark = page->bits + words;
+	page->old = page->bits + words * 2;
+	page->remembered = page->bits + words * 3;
+	page->data = (char*)(((uintptr_t)(page->bits + words * 4) + 15)
+			     & ~(uintptr_t)15);
+	page->next = h->pages;
+	h->pages = page;
+	return page;
+}
+
+um_Page* heap_page_of(void* a) {
+	return (um_Page*)((uintptr_t)a & ~(uintptr_t)(UM_PAGE_SIZE - 1));
+}
+
+size_t heap_slot(um_Page* page, void* a) {
+	return ((char*)a - page->data) / heaps[page->kind].size;
+}
+
+void heap_finalize(um_HeapKind kind, void* a) {
+	size_t i;
+	um_Table* at;
+	um_TableEntry *e, *next;
+
+	switch (kind) {
+		case HEAP_STRING: free(((struct um_String*)a)->value); break;
+		case HEAP_TABLE:
+			at = (um_Table*)a;
+			for (i = 0; i < at->capacity; i++) {
+				for (e = at->data[i]; e; e = next) {
+					next = e->next;
+					free(e);
+					/* If you're reading this,
+					 * please go to sleep;
+					 * it's late */
+				}
+			}
+
+			free(at->data);
+			break;
+		case HEAP_CODE:
+			free(((um_Code*)a)->ops);
+			free(((um_Code*)a)->constants);
+			free(((um_Code*)a)->locals);
+			free(((um_Code*)a)->cells);
+#ifdef UM_JIT
+			if (((um_Code*)a)->jit) {
+				munmap(((um_Code*)a)->jit,
+				       ((um_Code*)a)->jit_size);
+				free(((um_Code*)a)->jit_map);
+			}
+#endif
+			break;
+		case HEAP_VECTOR: vector_free((um_Vector*)a); break;
+		default: break;
+	}
+}
+
+/* Free whatever on the page didn't survive the last full collection and hand
+ * the page back once nothing on it is left, unless it is the page currently
+ * being bumped */
+void heap_sweep_next(um_Heap* h) {
+	um_Page* page = *h->sweep;
+	void *a, *free_list = h->free;
+	size_t i;
+	uint64_t live = 0;
+
+	for (i = 0; i < page->limit; i++) {
+		a = page->data + i * h->size;
+		if (bit_get(page->used, i)) {
+			if (bit_get(page->old, i)) { continue; }
+
+			heap_finalize(page->kind, a);
+			bit_clear(page->used, i);
+		}
+
+		*(void**)a = free_list;
+		free_list = a;
+	}
+
+	for (i = 0; i < page->words; i++) { live |= page->used[i]; }
+
+	/* Slots bumped since the collection may be on the free list already */
+	if (!live && page != h->pages && page->bump == page->limit) {
+		*h->sweep = page->next;
+		free(page);
+	} else {
+		page->swept = true;
+		h->free = free_list;
+		h->sweep = &page->next;
+	}
+
+	if (!*h->sweep) { h->sweep = NULL; }
+}
+
+void heap_free(void* a) {
+	um_Page* page = heap_page_of(a);
+	um_Heap* h = &heaps[page->kind];
+	size_t slot = heap_slot(page, a);
+
+	heap_finalize(page->kind, a);
+	bit_clear(page->used, slot);
+
+	/* A page still waiting on its sweep may yet be handed back whole, and
+	 * the sweep frees the slot then, unless it was bumped since */
+	if (page->swept || slot >= page->limit) {
+		*(void**)a = h->free;
+		h->free = a;
+	}
+}
+
+void* heap_alloc(um_HeapKind kind) {
+	um_Heap* h = &heaps[kind];
+	um_Page* page;
+	void* a;
+	size_t i;
+
+	while (!h->free && h->sweep) { heap_sweep_next(h); }
+
+	if (h->free) {
+		a = h->free;
+		h->free = *(void**)a;
+		page = heap_page_of(a);
+		i = heap_slot(page, a);
+	} else {
+		page = h->pages;
+		if (!page || page->bump == page->count) {
+			page = heap_page_new(kind);
+		}
+
+		/* Callers have no way to fail, nor is it safe to collect while
+		 * what they allocate for is held only by them */
+		if (!page) {
+			um_print_error(MakeErrorCode(ERROR_MEMORY));
+			exit(EXIT_FAILURE);
+		}
+
+		i = page->bump++;
+		a = page->data + i * h->size;
+	}
+
+	bit_set(page->used, i);
+	if (gc_phase == GC_MARK) { bit_set(page->mark, i); }
+	alloc_count++;
+	return a;
+}
 
 um_Noun cons(um_Noun car_val, um_Noun cdr_val) {
 	um_Pair* a;
 	um_Noun p;
-	alloc_count++;
 
-	a = (um_Pair*)calloc(1, sizeof(um_Pair));
-	a->mark = 0;
-	a->next = pair_head;
-	pair_head = a;
+	a = (um_Pair*)heap_alloc(HEAP_PAIR);
 
 	p.type = pair_t;
+	p.mut = true;
 	p.value.pair = a;
 
 	car(p) = car_val;
 	cdr(p) = cdr_val;
 
 	stack_add(p);
+	garbage_collector_young(p);
 
 	return p;
 }
 
+void set_car(um_Noun p, um_Noun v) {
+	garbage_collector_barrier(p, car(p), v);
+	car(p) = v;
+}
+
+void set_cdr(um_Noun p, um_Noun v) {
+	garbage_collector_barrier(p, cdr(p), v);
+	cdr(p) = v;
+}
+
 void vector_new(um_Vector* a) {
 	a->capacity = sizeof(a->static_data) / sizeof(a->static_data[0]);
 	a->size = 0;
@@ -317,12 +777,24 @@ void noun_to_vector(um_Noun a, um_Vector* v) {
 
 um_Noun vector_to_noun(um_Vector* a, size_t start) {
 	um_Noun r = nil;
-	size_t i;
-	for (i = start; i < a->size; i++) {
-		if (!isnil(a->data[i])) { r = cons(a->data[i], r); }
-	}
+	size_t i = a->size;
+
+	while (i > start) { r = cons(a->data[--i], r); }
+
+	return r;
+}
+
+um_Noun new_vector() {
+	um_Noun a;
+	a.value.vector_v = (um_Vector*)heap_alloc(HEAP_VECTOR);
+	vector_new(a.value.vector_v);
+
+	a.type = vector_t;
+	a.mut = true;
+	stack_add(a);
+	garbage_collector_young(a);
 
-	return reverse_list(r);
+	return a;
 }
 
 void um_repl() {
@@ -390,7 +862,9 @@ void stack_add(um_Noun a) {
 		case closure_t:
 		case macro_t:
 		case string_t:
-		case table_t: break;
+		case table_t:
+		case code_t:
+		case vector_t: break;
 		default: return;
 	}
 
@@ -435,6 +909,7 @@ um_Noun cast(um_Noun a, um_NounType t) {
 		case nil_t:
 		case noreturn_t: return nil_to_t(nil, t);
 		case real_t: return real_to_t(a.value.number, t);
+		case integer_t: return integer_to_t(a.value.integer, t);
 		case noun_t: return noun_to_t(a.value.symbol, t);
 		case string_t: return string_to_t(a.value.string->value, t);
 		case bool_t: return bool_to_t(a.value.bool_v, t);
@@ -453,6 +928,8 @@ char* type_to_string(um_NounType a) {
 		case string_t: return "String";
 		case noun_t: return "Noun";
 		case real_t: return "Float";
+		case integer_t: return "Integer";
+		case code_t: return "Code";
 		case builtin_t: return "Builtin";
 		case closure_t: return "Closure";
 		case macro_t: return "Macro";
@@ -481,15 +958,22 @@ um_Noun nil_to_t(um_Noun x __attribute__((unused)), um_NounType t) {
 	switch (t) {
 		case nil_t: return nil;
 		case real_t: return new_number(NAN);
+		case integer_t: return new_integer(0);
 		case pair_t: return cons(nil, nil);
 		case bool_t: return new_bool(false);
 		case type_t: return new_type(nil_t);
-		case string_t: return new_string("nil");
+		case string_t: return new_string(copy_string("nil"));
 		case noun_t: return intern("nil");
 		default: return nil;
 	}
 }
 
+/* Whether x is within the range of integers, outside of which converting it
+ * to one is undefined */
+static inline bool real_fits_integer(double x) {
+	return x >= -0x1p63 && x < 0x1p63;
+}
+
 um_Noun real_to_t(double x, um_NounType t) {
 	if (t == real_t) { return new_number(x); }
 
@@ -507,6 +991,31 @@ um_Noun real_to_t(double x, um_NounType t) {
 		case pair_t: return cons(new_number(x), nil);
 		case string_t: return new_string(buf);
 		case type_t: return new_type(real_t);
+		case integer_t:
+			/* Floats beyond either end become the integer there */
+			if (!isfinite(x)) { return new_integer(0); }
+			return new_integer(real_fits_integer(x) ? (int64_t)x
+					   : x < 0	       ? INT64_MIN
+							       : INT64_MAX);
+		default: return nil;
+	}
+}
+
+um_Noun integer_to_t(int64_t x, um_NounType t) {
+	char* buf = NULL;
+	if (t == noun_t || t == string_t) {
+		buf = calloc(21, sizeof(char));
+		snprintf(buf, 21, "%lld", (long long)x);
+	}
+
+	switch (t) {
+		case nil_t: return nil;
+		case noun_t: return intern(buf);
+		case bool_t: return new_bool(x > 0);
+		case pair_t: return cons(new_integer(x), nil);
+		case string_t: return new_string(buf);
+		case type_t: return new_type(integer_t);
+		case real_t: return new_number((double)x);
 		default: return nil;
 	}
 }
@@ -516,7 +1025,8 @@ um_Noun noun_to_t(char* x, um_NounType t) {
 		case pair_t: return cons(intern(x), nil);
 		case noun_t: return intern(x);
 		case real_t: return new_number(strtod(x, NULL));
-		case string_t: return new_string(x);
+		case integer_t: return new_integer(strtoll(x, NULL, 10));
+		case string_t: return new_string(copy_string(x));
 		case type_t: return new_type(noun_t);
 		case bool_t:
 			return new_bool(x != NULL
@@ -530,7 +1040,8 @@ um_Noun string_to_t(char* x, um_NounType t) {
 		case pair_t: return cons(intern(x), nil);
 		case noun_t: return intern(x);
 		case real_t: return new_number(strtod(x, NULL));
-		case string_t: return new_string(x);
+		case integer_t: return new_integer(strtoll(x, NULL, 10));
+		case string_t: return new_string(copy_string(x));
 		case type_t: return new_type(noun_t);
 		case bool_t:
 			return new_bool(x != NULL && strcmp(x, "nil")
@@ -544,9 +1055,10 @@ um_Noun bool_to_t(bool x, um_NounType t) {
 		case bool_t: return new_bool(x);
 		case pair_t: return cons(new_bool(x), nil);
 		case real_t: return new_number((double)x);
+		case integer_t: return new_integer(x);
 		case noun_t: return x ? intern("true") : intern("false");
 		case string_t:
-			return x ? new_string("true") : new_string("false");
+			return new_string(copy_string(x ? "true" : "false"));
 		case type_t: return new_type(bool_t);
 		default: return nil;
 	}
@@ -556,83 +1068,89 @@ um_Noun type_to_t(um_NounType x, um_NounType t) {
 	switch (t) {
 		case type_t: return new_type(type_t);
 		case noun_t: return intern(error_string[x]);
-		case string_t: return new_string((char*)error_string[x]);
+		case string_t: return new_string(copy_string(error_string[x]));
 		case bool_t: return new_bool(!x);
 		case pair_t: return cons(new_type(x), nil);
 		default: return nil;
 	}
 }
 
+size_t hash_string(const char* s) {
+	size_t h = 14695981039346656037ULL;
+	for (; *s; s++) { h = (h ^ (unsigned char)*s) * 1099511628211ULL; }
+
+	return h;
+}
+
+void symbol_table_grow() {
+	char** old = symbol_table;
+	size_t i, j, old_capacity = symbol_capacity;
+
+	symbol_capacity *= 2;
+	symbol_table = calloc(symbol_capacity, sizeof(char*));
+	for (i = 0; i < old_capacity; i++) {
+		if (!old[i]) { continue; }
+
+		j = hash_string(old[i]) & (symbol_capacity - 1);
+		while (symbol_table[j]) { j = (j + 1) & (symbol_capacity - 1); }
+		symbol_table[j] = old[i];
+	}
+
+	free(old);
+}
+
 um_Noun intern(const char* s) {
 	um_Noun a;
-	int i;
+	size_t i;
 
-	for (i = symbol_size - 1; i >= 0; i--) {
-		char* t = symbol_table[i];
-		if (!strcmp(t, s)) {
-			a.type = noun_t;
-			a.value.symbol = t;
+	a.type = noun_t;
+	a.mut = true;
+
+	i = hash_string(s) & (symbol_capacity - 1);
+	for (; symbol_table[i]; i = (i + 1) & (symbol_capacity - 1)) {
+		if (!strcmp(symbol_table[i], s)) {
+			a.value.symbol = symbol_table[i];
 			return a;
 		}
 	}
 
-	a.type = noun_t;
-	a.mut = true;
 	a.value.symbol = calloc(strlen(s) + 1, sizeof(char));
 	strcpy(a.value.symbol, s);
-	if (symbol_size >= um_global_symbol_capacity) {
-		um_global_symbol_capacity *= 2;
-		symbol_table = realloc(
-		    symbol_table, um_global_symbol_capacity * sizeof(char*));
-	}
-
-	symbol_table[symbol_size] = a.value.symbol;
+	symbol_table[i] = a.value.symbol;
 	symbol_size++;
 
+	if (symbol_size * 2 > symbol_capacity) { symbol_table_grow(); }
+
 	return a;
 }
 
-um_Error new_closure(um_Noun env, um_Noun args, um_Noun body, um_Noun* result) {
-	um_Noun p;
-
-	if (!listp(body)) { return MakeErrorCode(ERROR_SYNTAX); }
-
-	p = args;
-	while (!isnil(p)) {
-		if (p.type == noun_t)
-			break;
-		else if (p.type != pair_t
-			 || (car(p).type != noun_t && car(p).type != pair_t))
-			return MakeErrorCode(ERROR_TYPE);
-		p = cdr(p);
-	}
-
-	if (isnil(cdr(body))) {
-		p = body;
-	} else {
-		p = cons(cons(sym_do, body), nil);
-	}
-
-	*result = cons(env, cons(args, p));
-	result->mut = true;
-	result->type = closure_t;
+/* A closure is (env args body . code), code being the prototype compiled from
+ * the lambda it was made by and shared with every other closure it makes */
+um_Noun new_closure(um_Noun env, um_Noun proto) {
+	um_Code* code = proto.value.code;
+	um_Noun a = cons(env, cons(code->args, cons(code->body, proto)));
+	a.type = closure_t;
+	return a;
+}
 
-	return MakeErrorCode(OK);
+/* Strings own their characters, so text that isn't already on the heap is
+ * copied before it is given to new_string */
+char* copy_string(const char* x) {
+	char* s = (char*)malloc(strlen(x) + 1);
+	strcpy(s, x);
+	return s;
 }
 
 um_Noun new_string(char* x) {
 	um_Noun a;
 	struct um_String* s;
-	alloc_count++;
-	s = a.value.string = calloc(1, sizeof(struct um_String));
+	s = a.value.string = (struct um_String*)heap_alloc(HEAP_STRING);
 	s->value = x;
-	s->mark = 0;
-	s->next = str_head;
-	str_head = s;
 
 	a.type = string_t;
 	a.mut = true;
 	stack_add(a);
+	garbage_collector_young(a);
 
 	return a;
 }
@@ -713,11 +1231,20 @@ um_Error parse_simple(const char* start, const char* end, um_Noun* result) {
 	um_Noun a1, a2;
 	long len, i;
 	const char* ps;
+	long long ival;
+	double val;
+
+	/* Integer literals that fit in 64 bits are read exactly */
+	errno = 0;
+	ival = strtoll(start, &p, 10);
+	if (p == end && p != start && errno != ERANGE) {
+		*result = new_integer(ival);
+		return MakeErrorCode(OK);
+	}
 
-	double val = strtod(start, &p);
+	val = strtod(start, &p);
 	if (p == end) {
-		result->type = real_t;
-		result->value.number = val;
+		*result = new_number(val);
 		return MakeErrorCode(OK);
 	} else if (start[0] == '"') {
 		result->type = string_t;
@@ -829,8 +1356,7 @@ um_Error parse_simple(const char* start, const char* end, um_Noun* result) {
 
 				*result
 				    = cons(intern("range"),
-					   cons(cast(a1, real_t),
-						cons(cast(a2, real_t), nil)));
+					   cons(a1, cons(a2, nil)));
 
 				return MakeErrorCode(OK);
 			}
@@ -867,7 +1393,7 @@ um_Error read_list(const char* start, const char** end, um_Noun* result) {
 			err = read_expr(*end, end, &item);
 			if (err._) { return err; }
 
-			cdr(p) = item;
+			set_cdr(p, item);
 
 			err = um_lex(*end, &token, end);
 			if (!err._ && token[0] != ')') {
@@ -884,7 +1410,7 @@ um_Error read_list(const char* start, const char** end, um_Noun* result) {
 			*result = cons(item, nil);
 			p = *result;
 		} else {
-			cdr(p) = cons(item, nil);
+			set_cdr(p, cons(item, nil));
 			p = cdr(p);
 		}
 	}
@@ -941,9 +1467,9 @@ um_Error read_block(const char* start, const char** end, um_Noun* result) {
 }
 
 um_Error read_vector(const char* start, const char** end, um_Noun* result) {
+	um_Noun a = new_vector();
+	um_Vector* v = a.value.vector_v;
 	*result = nil;
-	um_Vector* v = calloc(1, sizeof(um_Vector));
-	vector_new(v);
 	*end = start;
 
 	while (1) {
@@ -954,7 +1480,7 @@ um_Error read_vector(const char* start, const char** end, um_Noun* result) {
 		if (err._) { return err; }
 
 		if (token[0] == ']') {
-			*result = new_vector(v);
+			*result = a;
 			return MakeErrorCode(OK);
 		}
 
@@ -966,7 +1492,7 @@ um_Error read_vector(const char* start, const char** end, um_Noun* result) {
 	}
 }
 
-um_Error read_expr(const char* input, const char** end, um_Noun* result) {
+um_Error read_form(const char* input, const char** end, um_Noun* result) {
 	char* token;
 	um_Error err;
 
@@ -1032,40 +1558,52 @@ um_Error read_expr(const char* input, const char** end, um_Noun* result) {
 	}
 }
 
-um_Error apply(um_Noun fn, um_Vector* v_params, um_Noun* result) {
-	um_Noun arg_names, env, body, a;
+um_Error read_expr(const char* input, const char** end, um_Noun* result) {
 	um_Error err;
+
+	if (um_nest == UM_NEST_MAX) { return MakeErrorCode(ERROR_STACK); }
+
+	um_nest++;
+	err = read_form(input, end, result);
+	um_nest--;
+	return err;
+}
+
+um_Error apply(um_Noun fn, um_Vector* v_params, um_Noun* result) {
+	um_Noun a;
+	um_TableEntry* e;
 	size_t index, i;
 
 	if (fn.type == builtin_t) {
 		return (*fn.value.builtin)(v_params, result);
 	} else if (fn.type == closure_t) {
-		arg_names = car(cdr(fn));
-		env = env_create(car(fn), list_len(arg_names));
-		body = cdr(cdr(fn));
-
-		err = env_bind(env, arg_names, v_params);
-		if (err._) { return err; }
+		return vm_apply(fn, v_params, result);
+	} else if (fn.type == table_t) {
+		if (v_params->size != 1) { return MakeErrorCode(ERROR_ARGS); }
 
-		err = eval_expr(car(body), env, result);
-		if (err._) { return err; }
+		e = table_get(fn.value.table, v_params->data[0]);
+		if (!e) {
+			cur_expr = v_params->data[0];
+			return MakeErrorCode(ERROR_UNBOUND);
+		}
 
+		*result = e->v;
 		return MakeErrorCode(OK);
 	} else if (fn.type == string_t) {
 		if (v_params->size != 1) { return MakeErrorCode(ERROR_ARGS); }
 
-		index = (size_t)(v_params->data[0]).value.number;
-		*result
-		    = new_string((char[]){fn.value.string->value[index], '\0'});
+		index = cast(v_params->data[0], integer_t).value.integer;
+		*result = new_string(
+		    copy_string((char[]){fn.value.string->value[index], '\0'}));
 		return MakeErrorCode(OK);
 	} else if (fn.type == pair_t && listp(fn)) {
 		if (v_params->size != 1) { return MakeErrorCode(ERROR_ARGS); }
 
-		if (v_params->data[0].type != real_t) {
+		if (!isnumber(v_params->data[0])) {
 			return MakeErrorCode(ERROR_TYPE);
 		}
 
-		index = (size_t)(v_params->data[0]).value.number;
+		index = cast(v_params->data[0], integer_t).value.integer;
 		a = fn;
 
 		for (i = 0; i < index; i++) {
@@ -1093,7 +1631,7 @@ um_Noun copy_list(um_Noun list) {
 	list = cdr(list);
 
 	while (!isnil(list)) {
-		cdr(p) = cons(car(list), nil);
+		set_cdr(p, cons(car(list), nil));
 		p = cdr(p);
 		list = cdr(list);
 		if (list.type != pair_t) {
@@ -1116,6 +1654,16 @@ um_Noun* list_index(um_Noun* list, size_t index) {
 	return &car(a);
 }
 
+/* Expansions cached by macex depend on which names are bound to macros */
+/* Called before the binding e, or a new one when it is NULL, takes value */
+void macex_forget(um_TableEntry* e, um_Noun value) {
+	if (value.type == macro_t
+	    || (e && (e->v.type == macro_t || macex_ran))) {
+		macex_epoch++;
+		macex_ran = false;
+	}
+}
+
 um_Error env_assign_eq(um_Noun env, char* symbol, um_Noun value) {
 	while (1) {
 		um_Noun parent = car(env);
@@ -1123,6 +1671,8 @@ um_Error env_assign_eq(um_Noun env, char* symbol, um_Noun value) {
 		um_TableEntry* a = table_get_sym(ptbl, symbol);
 		if (a) {
 			if (!a->v.mut) { return MakeErrorCode(ERROR_NOMUT); }
+			macex_forget(a, value);
+			garbage_collector_barrier(cdr(env), a->v, value);
 			a->v = value;
 			return MakeErrorCode(OK);
 		}
@@ -1176,456 +1726,2838 @@ char* read_file(const char* path) {
 	return buf;
 }
 
-um_Error eval_expr(um_Noun expr, um_Noun env, um_Noun* result) {
-	um_Error err;
-	um_Noun fn, op, cond, args, sym, val, name, macro, p, r, arg_names;
-	size_t ss = stack_size;
-	um_Vector v_params;
-start:
-	stack_add(env);
-	cur_expr = isnil(expr) ? cur_expr : expr;
-	if (expr.type == noun_t) {
-		err = env_get(env, expr.value.symbol, result);
-		return err;
-	} else if (expr.type != pair_t) {
-		*result = expr;
-		return MakeErrorCode(OK);
-	} else {
-		op = car(expr);
-		args = cdr(expr);
-
-		if (op.type == noun_t) {
-			if (op.value.symbol == sym_if.value.symbol) {
-				p = args;
-				while (!isnil(p)) {
-					if (isnil(cdr(p))
-					    || (cdr(p).type == bool_t
-						&& cdr(p).value.bool_v
-						       == false)) {
-
-						expr = car(p);
-						goto start;
-					}
-
-					err = eval_expr(car(p), env, &cond);
-					if (err._) {
-						stack_restore(ss);
-						return err;
-					}
-
-					if (!isnil(cond)
-					    && cast(cond, bool_t)
-						   .value.bool_v) {
-
-						expr = car(cdr(p));
-						goto start;
-					}
+um_Noun new_code(um_Noun args, um_Noun body) {
+	um_Noun a;
+	um_Code* c;
+	c = a.value.code = (um_Code*)heap_alloc(HEAP_CODE);
+	c->ops = NULL;
+	c->size = c->capacity = 0;
+	c->constants = NULL;
+	c->constants_size = c->constants_capacity = 0;
+	c->args = args;
+	c->body = body;
+	c->max_stack = 0;
+	c->locals = NULL;
+	c->locals_size = c->params = 0;
+	c->simple = true;
+	c->heap = false;
+	c->cells = NULL;
+	c->globals = nil;
+#ifdef UM_JIT
+	c->calls = c->jit_size = 0;
+	c->jit = NULL;
+	c->jit_map = NULL;
+#endif
 
-					p = cdr(cdr(p));
-				}
+	a.type = code_t;
+	a.mut = false;
+	stack_add(a);
+	garbage_collector_young(a);
+	return a;
+}
 
-				*result = nil;
-				stack_restore_add(ss, *result);
-				return MakeErrorCode(OK);
-			} else if (op.value.symbol == sym_cond.value.symbol) {
-				um_Noun list
-				    = !isnil(args) ? reverse_list(args) : nil;
-				um_Noun n = cons(nil, nil);
-				while (!isnil(list)) {
-					n = cons(
-					    cons(
-						sym_if,
-						cons(
-						    !isnil(car(list))
-							? car(car(list))
-							: nil,
-						    cons(!isnil(car(list))
-								 && !isnil(cdr(
-								     car(list)))
-							     ? car(
-								 cdr(car(list)))
-							     : nil,
-							 n))),
-					    nil);
-					pop(list);
-				}
+/* Index of the last slot named sym, which is the innermost let's when there
+ * are several, locals_size if there is none */
+size_t code_local(um_Code* code, um_Noun sym) {
+	size_t i;
+	for (i = code->locals_size; i > 0; i--) {
+		if (code->locals[i - 1].value.symbol == sym.value.symbol) {
+			return i - 1;
+		}
+	}
 
-				err = eval_expr(car(n), env, &cond);
-				if (err._) {
-					stack_restore(ss);
-					return err;
-				}
+	return code->locals_size;
+}
 
-				*result = cond;
-				stack_restore_add(ss, *result);
-				return MakeErrorCode(OK);
-			} else if (op.value.symbol == sym_match.value.symbol) {
-				um_Noun pred = !isnil(args) ? car(args) : nil;
-				um_Noun list = !isnil(args) && !isnil(cdr(args))
-						 ? reverse_list(cdr(args))
-						 : nil;
-				um_Noun n = cons(nil, nil);
-				while (!isnil(list)) {
-					n = cons(
-					    cons(
-						sym_if,
-						cons(
-						    cons(
-							intern("apply"),
-							cons(
-							    !isnil(car(list))
-								? car(car(list))
-								: nil,
-							    cons(
-								cons(
-								    intern(
-									"quote"),
-								    cons(
-									cons(
-									    pred,
-									    nil),
-									nil)),
-								nil))),
-						    cons(!isnil(car(list))
-								 && !isnil(cdr(
-								     car(list)))
-							     ? car(
-								 cdr(car(list)))
-							     : nil,
-							 n))),
-					    nil);
-
-					pop(list);
-				}
+/* The functions being compiled, innermost first. captures is set once one
+ * uses a local of a function around it, and the slots below shared are those
+ * of its own that functions made in it use */
+typedef struct um_Scope {
+	struct um_Scope* parent;
+	um_Code* code;
+	bool captures;
+	size_t shared;
+} um_Scope;
+
+/* A named let compiled as a loop, calls of name in its body storing their
+ * arguments in the size slots from first on and jumping back to start */
+typedef struct {
+	um_Noun name;
+	size_t first, size, start;
+} um_Loop;
 
-				err = eval_expr(car(n), env, &cond);
-				if (err._) {
-					stack_restore(ss);
-					return err;
-				}
+/* loops counts the loops around what is being compiled in its function */
+typedef struct {
+	um_Noun code;
+	size_t depth, loops;
+	um_Scope* scope;
+	um_Loop* loop;
+} um_Compiler;
+
+/* Where compiling stood, to go back to when code compiled to run in place in
+ * a loop turns out to share a binding between iterations */
+typedef struct {
+	size_t size, depth, shared;
+	bool heap;
+} um_Mark;
+
+void compile_expr(um_Compiler* c, um_Noun expr, bool tail);
+void compile_form(um_Compiler* c, um_Noun expr, bool tail);
+
+/* Appends an instruction changing the stack depth by effect and returns the
+ * position of its operand, for jumps to be patched later */
+size_t compile_emit(um_Compiler* c, um_Opcode op, int32_t x, int effect) {
+	um_Code* code = c->code.value.code;
+	if (code->size + 2 > code->capacity) {
+		code->capacity = code->capacity ? code->capacity * 2 : 16;
+		code->ops = (int32_t*)realloc(code->ops,
+					      code->capacity * sizeof(int32_t));
+	}
 
-				*result = cond;
-				stack_restore_add(ss, *result);
-				return MakeErrorCode(OK);
-			} else if (op.value.symbol == sym_switch.value.symbol) {
-				um_Noun pred = !isnil(args) ? car(args) : nil;
-				um_Noun list = !isnil(args) && !isnil(cdr(args))
-						 ? reverse_list(cdr(args))
-						 : nil;
-				um_Noun n = cons(nil, nil);
-
-				while (!isnil(list)) {
-					n = cons(
-					    cons(
-						sym_if,
-						cons(
-						    cons(intern("="),
-							 cons(!isnil(car(list))
-								  ? car(
-								      car(list))
-								  : nil,
-							      cons(pred, nil))),
-						    cons(!isnil(car(list))
-								 && !isnil(cdr(
-								     car(list)))
-							     ? car(
-								 cdr(car(list)))
-							     : nil,
-							 n))),
-					    nil);
-
-					pop(list);
-				}
+	code->ops[code->size++] = op;
+	code->ops[code->size++] = x;
+	c->depth += effect;
+	if (c->depth > code->max_stack) { code->max_stack = c->depth; }
 
-				err = eval_expr(car(n), env, &cond);
-				if (err._) {
-					stack_restore(ss);
-					return err;
-				}
+	return code->size - 1;
+}
 
-				*result = cond;
-				stack_restore_add(ss, *result);
-				return MakeErrorCode(OK);
-			} else if (op.value.symbol == sym_set.value.symbol) {
-				if (isnil(args) || isnil(cdr(args))) {
-					stack_restore(ss);
-					return MakeErrorCode(ERROR_ARGS);
-				}
+int32_t compile_constant(um_Compiler* c, um_Noun a) {
+	um_Code* code = c->code.value.code;
+	garbage_collector_barrier(c->code, nil, a);
+	if (code->constants_size == code->constants_capacity) {
+		code->constants_capacity
+		    = code->constants_capacity ? code->constants_capacity * 2 : 8;
+		code->constants = (um_Noun*)realloc(
+		    code->constants, code->constants_capacity * sizeof(um_Noun));
+		code->cells = (um_TableEntry**)realloc(
+		    code->cells,
+		    code->constants_capacity * sizeof(um_TableEntry*));
+	}
 
-				sym = car(args);
+	code->cells[code->constants_size] = NULL;
+	code->constants[code->constants_size] = a;
+	return code->constants_size++;
+}
 
-				if (env_get(env, sym.value.symbol, result)._) {
-					cur_expr = sym;
-					return MakeErrorCode(ERROR_UNBOUND);
-				}
+void compile_push(um_Compiler* c, um_Noun a) {
+	compile_emit(c, OP_CONST, compile_constant(c, a), 1);
+}
 
-				if (sym.type == pair_t) {
+/* Malformed special forms raise their error when reached, like they would
+ * have when interpreted, rather than when compiled */
+void compile_fail(um_Compiler* c, um_ErrorCode e) {
+	compile_emit(c, OP_FAIL, e, 1);
+}
 
-					err = new_closure(
-					    env, cdr(sym), cdr(args), result);
-					sym = car(sym);
+/* Adds a slot named sym to code, even if there is one already */
+size_t compile_slot(um_Code* code, um_Noun sym) {
+	code->locals = (um_Noun*)realloc(
+	    code->locals, (code->locals_size + 1) * sizeof(um_Noun));
+	code->locals[code->locals_size] = sym;
+	return code->locals_size++;
+}
 
-					if (sym.type != noun_t) {
-						return MakeErrorCode(
-						    ERROR_TYPE);
-					}
+/* Gives sym a slot in code unless it has one already */
+size_t compile_local(um_Code* code, um_Noun sym) {
+	size_t i = code_local(code, sym);
+	return i < code->locals_size ? i : compile_slot(code, sym);
+}
 
-					err = env_assign_eq(
-					    env, sym.value.symbol, *result);
-					*result = sym;
-					stack_restore_add(ss, *result);
-					return err;
-				} else if (sym.type == noun_t) {
-
-					err = eval_expr(
-					    car(cdr(args)), env, &val);
-					if (err._) {
-						stack_restore(ss);
-						return err;
-					}
+void compile_params(um_Code* code, um_Noun pattern) {
+	if (pattern.type == noun_t) {
+		compile_local(code, pattern);
+	} else if (pattern.type == pair_t) {
+		compile_params(code, car(pattern));
+		compile_params(code, cdr(pattern));
+	}
+}
 
-					*result = val;
-					err = env_assign_eq(
-					    env, sym.value.symbol, val);
-					stack_restore_add(ss, *result);
-					return err;
-				} else {
-					stack_restore(ss);
-					return MakeErrorCode(ERROR_TYPE);
-				}
-			} else if (op.value.symbol == sym_def.value.symbol) {
-				if (isnil(args) || isnil(cdr(args))) {
-					stack_restore(ss);
-					return MakeErrorCode(ERROR_ARGS);
+/* Gives a slot to every name a function body defs or macs, leaving the bodies
+ * of the functions it makes to their own scan */
+void compile_scan(um_Code* code, um_Noun expr) {
+	um_Noun op, args;
+
+	if (expr.type != pair_t) { return; }
+
+	op = car(expr);
+	args = cdr(expr);
+	if (op.type == noun_t && args.type == pair_t) {
+		if (op.value.symbol == sym_quote.value.symbol
+		    || op.value.symbol == sym_fn.value.symbol
+		    || op.value.symbol == intern("\\").value.symbol
+		    || op.value.symbol == sym_defun.value.symbol) {
+			return;
+		} else if (op.value.symbol == sym_def.value.symbol
+			   || op.value.symbol == sym_mac.value.symbol) {
+			if (car(args).type == noun_t) {
+				compile_local(code, car(args));
+				if (op.value.symbol == sym_mac.value.symbol) {
+					return;
 				}
+			} else if (car(args).type == pair_t
+				   && car(car(args)).type == noun_t) {
+				compile_local(code, car(car(args)));
+				return;
+			}
+		} else if ((op.value.symbol == sym_set.value.symbol
+			    || op.value.symbol == sym_const.value.symbol)
+			   && car(args).type == pair_t) {
+			return;
+		}
+	}
 
-				sym = car(args);
+	for (; expr.type == pair_t; expr = cdr(expr)) {
+		compile_scan(code, car(expr));
+	}
+}
 
-				if (sym.type == pair_t) {
+/* Finds the function declaring sym, depth functions out from the one being
+ * compiled, and its slot there */
+bool compile_resolve(um_Compiler* c,
+		     um_Noun sym,
+		     int32_t* depth,
+		     int32_t* slot) {
+	um_Scope *s, *t;
+	size_t i;
 
-					err = new_closure(
-					    env, cdr(sym), cdr(args), result);
-					sym = car(sym);
+	for (s = c->scope, *depth = 0; s; s = s->parent, (*depth)++) {
+		i = code_local(s->code, sym);
+		if (i < s->code->locals_size) {
+			for (t = c->scope; t != s; t = t->parent) {
+				t->captures = true;
+			}
 
-					if (sym.type != noun_t) {
-						return MakeErrorCode(
-						    ERROR_TYPE);
-					}
+			if (*depth && i >= s->shared) { s->shared = i + 1; }
+			*slot = i;
+			return true;
+		}
+	}
 
-					err = env_assign(
-					    env, sym.value.symbol, *result);
-					*result = sym;
-					stack_restore_add(ss, *result);
-					return err;
-				} else if (sym.type == noun_t) {
-
-					err = eval_expr(
-					    car(cdr(args)), env, &val);
-					if (err._) {
-						stack_restore(ss);
-						return err;
-					}
+	return false;
+}
 
-					*result = val;
-					err = env_assign(
-					    env, sym.value.symbol, val);
-					stack_restore_add(ss, *result);
-					return err;
-				} else {
-					stack_restore(ss);
-					return MakeErrorCode(ERROR_TYPE);
-				}
-			} else if (op.value.symbol == sym_const.value.symbol) {
-				if (isnil(args) || isnil(cdr(args))) {
-					stack_restore(ss);
-					return MakeErrorCode(ERROR_ARGS);
-				}
+void compile_lookup(um_Compiler* c, um_Noun sym) {
+	int32_t depth, slot;
 
-				sym = car(args);
+	if (!compile_resolve(c, sym, &depth, &slot)) {
+		compile_emit(c, OP_GLOBAL, compile_constant(c, sym), 1);
+	} else if (depth == 0) {
+		compile_emit(c, OP_LOCAL, slot, 1);
+	} else {
+		compile_emit(c, OP_ENV, depth << 16 | slot, 1);
+	}
+}
 
-				if (!env_get(env, sym.value.symbol, result)._) {
-					if (!result->mut) {
-						return MakeErrorCode(
-						    ERROR_NOMUT);
-					}
-				}
+/* Binds sym to the value on top of the stack, leaving it there. def and mac
+ * always bind in the function being compiled, the others rebind sym where it
+ * is found */
+void compile_store(um_Compiler* c, um_BindKind kind, um_Noun sym) {
+	int32_t depth, slot;
+
+	if (c->scope && (kind == BIND_DEF || kind == BIND_MAC)) {
+		compile_emit(c,
+			     OP_STORE_LOCAL,
+			     kind << 24 | compile_local(c->scope->code, sym),
+			     0);
+	} else if (!compile_resolve(c, sym, &depth, &slot)) {
+		compile_emit(c,
+			     OP_STORE_GLOBAL,
+			     kind << 24 | compile_constant(c, sym),
+			     0);
+	} else if (depth == 0) {
+		compile_emit(c, OP_STORE_LOCAL, kind << 24 | slot, 0);
+	} else {
+		compile_emit(
+		    c, OP_STORE_ENV, kind << 24 | depth << 16 | slot, 0);
+	}
+}
+
+/* ns::name reads as (ns 'name). When ns is a namespace, a table bound with
+ * const in the global environment, and has name in it already, this is the
+ * entry for it */
+um_TableEntry* compile_namespace_entry(um_Compiler* c,
+				       um_Noun ns,
+				       um_Noun args,
+				       um_Noun* table) {
+	int32_t depth, slot;
+
+	if (args.type != pair_t || !isnil(cdr(args)) || car(args).type != pair_t
+	    || car(car(args)).type != noun_t
+	    || car(car(args)).value.symbol != sym_quote.value.symbol
+	    || cdr(car(args)).type != pair_t || !isnil(cdr(cdr(car(args))))) {
+		return NULL;
+	}
+
+	if (compile_resolve(c, ns, &depth, &slot)
+	    || env_get(env, ns.value.symbol, table)._ || table->type != table_t
+	    || table->mut) {
+		return NULL;
+	}
+
+	return table_get(table->value.table, car(cdr(car(args))));
+}
+
+/* Loads the binding of ns::name directly */
+bool compile_qualified(um_Compiler* c, um_Noun ns, um_Noun args) {
+	um_Noun table;
+	um_TableEntry* e = compile_namespace_entry(c, ns, args, &table);
+	int32_t k;
+
+	if (!e) { return false; }
+
+	k = compile_constant(c, table);
+	c->code.value.code->cells[k] = e;
+	compile_emit(c, OP_CELL, k, 1);
+	return true;
+}
+
+/* The global binding of sym, unless a function being compiled declares it */
+bool compile_global(um_Compiler* c, um_Noun sym, um_Noun* result) {
+	int32_t depth, slot;
+	return !compile_resolve(c, sym, &depth, &slot)
+	    && !env_get(env, sym.value.symbol, result)._;
+}
+
+/* Builtins without effects, whose results depend on their arguments alone */
+bool compile_pure(um_Builtin fn) {
+	return fn == builtin_add || fn == builtin_subtract
+	    || fn == builtin_multiply || fn == builtin_divide
+	    || fn == builtin_modulo || fn == builtin_less
+	    || fn == builtin_greater || fn == builtin_eq || fn == builtin_eq_l
+	    || fn == builtin_not || fn == builtin_and || fn == builtin_pow
+	    || fn == builtin_cbrt || fn == builtin_sin || fn == builtin_cos
+	    || fn == builtin_tan || fn == builtin_asin || fn == builtin_acos
+	    || fn == builtin_atan || fn == builtin_ceil || fn == builtin_floor
+	    || fn == builtin_float || fn == builtin_integer
+	    || fn == builtin_len || fn == builtin_type || fn == builtin_pairp
+	    || fn == builtin_string || fn == builtin_sum || fn == builtin_product
+	    || fn == builtin_dot || fn == builtin_min || fn == builtin_max;
+}
+
+/* Adds sym, bound to the builtin fn, to the guards code relies on, as pairs
+ * of a name and the builtin it must still be bound to */
+void compile_guard(um_Noun* guards, um_Noun sym, um_Noun fn) {
+	um_Noun p;
+
+	for (p = *guards; !isnil(p); p = cdr(p)) {
+		if (car(car(p)).value.symbol == sym.value.symbol) { return; }
+	}
+
+	*guards = cons(cons(sym, fn), *guards);
+}
+
+/* Tests each of guards when run, returning the chain of jumps taken when one
+ * fails, to be patched where code not relying on them starts */
+size_t compile_guards(um_Compiler* c, um_Noun guards) {
+	size_t fail = 0;
+	int32_t k;
+
+	for (; !isnil(guards); guards = cdr(guards)) {
+		k = compile_constant(c, car(car(guards)));
+		compile_constant(c, cdr(car(guards)));
+		compile_emit(c, OP_CHECK, k, 1);
+		fail = compile_emit(c, OP_JUMP_FALSE, fail, -1);
+	}
+
+	return fail;
+}
+
+/* Points the chain of jumps ending in to at the next op */
+void compile_patch(um_Compiler* c, size_t to) {
+	um_Code* code = c->code.value.code;
+	size_t next;
+
+	for (; to; to = next) {
+		next = code->ops[to];
+		code->ops[to] = code->size;
+	}
+}
+
+/* Evaluates expr while compiling if it is a literal, a name bound with const
+ * or a pure builtin applied to such, the builtin being whatever it names now.
+ * The names of builtins that could be bound to something else by the time
+ * the code runs are added to guards. Calls that would fail are left to fail
+ * when they run */
+#define UM_FOLD_ARGS 16
+bool compile_fold(um_Compiler* c,
+		  um_Noun expr,
+		  um_Noun* result,
+		  um_Noun* guards) {
+	um_Noun args[UM_FOLD_ARGS], fn, p, table, sym = nil;
+	um_TableEntry* e;
+	um_Vector v;
+	size_t argc = 0;
+	bool folded = true;
+
+	if (expr.type == noun_t) {
+		return compile_global(c, expr, result) && !result->mut;
+	} else if (expr.type != pair_t) {
+		*result = expr;
+		return true;
+	}
+
+	fn = car(expr);
+	p = cdr(expr);
+	if (fn.type == noun_t && fn.value.symbol == sym_quote.value.symbol) {
+		if (p.type != pair_t || !isnil(cdr(p))) { return false; }
+
+		*result = car(p);
+		return true;
+	}
+
+	if (fn.type == noun_t) {
+		sym = fn;
+		if (!compile_global(c, sym, &fn)) { return false; }
+	} else if (fn.type == pair_t && car(fn).type == noun_t
+		   && (e = compile_namespace_entry(
+			   c, car(fn), cdr(fn), &table))) {
+		fn = e->v;
+	} else {
+		return false;
+	}
+
+	if (fn.type != builtin_t || !compile_pure(fn.value.builtin)
+	    || um_nest == UM_NEST_MAX) {
+		return false;
+	}
+
+	if (!isnil(sym) && fn.mut) { compile_guard(guards, sym, fn); }
+
+	um_nest++;
+	for (; folded && p.type == pair_t; p = cdr(p)) {
+		folded = argc < UM_FOLD_ARGS
+		      && compile_fold(c, car(p), &args[argc++], guards);
+	}
+
+	um_nest--;
+	if (!folded || !isnil(p)) { return false; }
+
+	/* Builtins may read two arguments before checking how many they got */
+	for (v.size = argc; argc < UM_FOLD_ARGS; argc++) { args[argc] = nil; }
+	v.data = args;
+	v.capacity = UM_FOLD_ARGS;
+	return !fn.value.builtin(&v, result)._;
+}
+
+um_Error compile_check_lambda(um_Noun args, um_Noun body) {
+	um_Noun p;
+
+	if (!listp(body)) { return MakeErrorCode(ERROR_SYNTAX); }
+
+	p = args;
+	while (!isnil(p)) {
+		if (p.type == noun_t)
+			break;
+		else if (p.type != pair_t
+			 || (car(p).type != noun_t && car(p).type != pair_t))
+			return MakeErrorCode(ERROR_TYPE);
+		p = cdr(p);
+	}
+
+	return MakeErrorCode(OK);
+}
+
+/* Sets captures when the function uses a local of one around it. Besides
+ * those it reads and binds, a local it defs is looked for by name further
+ * out when read before it is bound */
+um_Noun compile_function(um_Scope* parent,
+			 um_Noun args,
+			 um_Noun body,
+			 bool* captures) {
+	um_Compiler c;
+	um_Scope scope, *s, *t;
+	um_Code* code;
+	size_t i, j;
+
+	body = isnil(cdr(body)) ? car(body) : cons(sym_do, body);
+	c.code = new_code(args, body);
+	c.depth = c.loops = 0;
+	c.scope = &scope;
+	c.loop = NULL;
+	scope.parent = parent;
+	scope.code = code = c.code.value.code;
+	scope.captures = false;
+	scope.shared = 0;
+
+	compile_params(code, args);
+	code->simple = listp(args) && code->locals_size == list_len(args);
+	code->params = code->simple ? code->locals_size : 0;
+	compile_scan(code, body);
+
+	compile_expr(&c, body, true);
+	compile_emit(&c, OP_RETURN, 0, -1);
+
+	for (i = code->params; i < code->locals_size; i++) {
+		if (code->locals[i].value.symbol
+		    == sym_out_of_scope.value.symbol) {
+			continue;
+		}
+
+		for (s = parent; s; s = s->parent) {
+			j = code_local(s->code, code->locals[i]);
+			if (j < s->code->locals_size) {
+				for (t = &scope; t != s; t = t->parent) {
+					t->captures = true;
+				}
+
+				if (j >= s->shared) { s->shared = j + 1; }
+				break;
+			}
+		}
+	}
+
+	*captures = scope.captures;
+	return c.code;
+}
+
+/* Pushes a closure of args and body, or raises the error they would. One
+ * using nothing of the functions around it is lifted out of them, made once
+ * now in the environment it would have found its globals in. Every run of the
+ * functions around it then yields that same closure, not a new one each time,
+ * which only its identity can tell apart */
+void compile_lambda(um_Compiler* c, um_Noun args, um_Noun body) {
+	um_Error err = compile_check_lambda(args, body);
+	um_Noun proto;
+	bool captures;
+
+	if (err._) {
+		compile_fail(c, err._);
+		return;
+	}
+
+	proto = compile_function(c->scope, args, body, &captures);
+	if (c->scope && !captures) {
+		compile_push(c, new_closure(env, proto));
+		return;
+	}
+
+	/* The closure captures the frame it is made in */
+	if (c->scope) { c->scope->code->heap = true; }
+	compile_emit(c, OP_CLOSURE, compile_constant(c, proto), 1);
+}
+
+void compile_if(um_Compiler* c, um_Noun p, bool tail) {
+	um_Code* code = c->code.value.code;
+	size_t exits = 0, next, patch;
+	um_Noun test, guards;
+
+	while (!isnil(p)) {
+		if (isnil(cdr(p))) {
+			compile_expr(c, car(p), tail);
+			goto done;
+		}
+
+		/* A test known when compiled, whatever is bound when it runs,
+		 * leaves only the branch it takes */
+		guards = nil;
+		if (compile_fold(c, car(p), &test, &guards) && isnil(guards)) {
+			if (um_truthy(test)) {
+				compile_expr(c, car(cdr(p)), tail);
+				goto done;
+			}
+
+			p = cdr(cdr(p));
+			continue;
+		}
+
+		compile_expr(c, car(p), false);
+		next = compile_emit(c, OP_JUMP_FALSE, 0, -1);
+		compile_expr(c, car(cdr(p)), tail);
+
+		/* Pending exits are chained through their operands */
+		exits = compile_emit(c, OP_JUMP, exits, -1);
+		code->ops[next] = code->size;
+		p = cdr(cdr(p));
+	}
+
+	compile_push(c, nil);
+done:
+	while (exits) {
+		patch = code->ops[exits];
+		code->ops[exits] = code->size;
+		exits = patch;
+	}
+}
+
+um_Noun compile_clause_body(um_Noun clause) {
+	return clause.type == pair_t && cdr(clause).type == pair_t
+		 ? car(cdr(clause))
+		 : nil;
+}
+
+/* Whether a switch clause is keyed by a literal number, string or quoted
+ * symbol, one that compares with = just like it hashes */
+bool compile_literal_key(um_Noun clause, um_Noun* key) {
+	if (clause.type != pair_t) { return false; }
+
+	*key = car(clause);
+	if (key->type == pair_t && car(*key).type == noun_t
+	    && car(*key).value.symbol == sym_quote.value.symbol
+	    && cdr(*key).type == pair_t && isnil(cdr(cdr(*key)))) {
+		*key = car(cdr(*key));
+	} else if (key->type == noun_t) {
+		return false;
+	}
+
+	switch (key->type) {
+		case integer_t:
+			/* Beyond 2^53 a float may equal more than one integer */
+			return key->value.integer <= (int64_t)1 << 53
+			    && key->value.integer >= -((int64_t)1 << 53);
+		case real_t:
+		case noun_t:
+		case string_t: return true;
+		default: return false;
+	}
+}
+
+/* The leading clauses of a switch keyed by literals are looked up in a table
+ * of where their bodies start, instead of being tested one at a time, while =
+ * is the builtin. Returns how many clauses the table covers, leaving in miss
+ * the jump taken when the subject is not in it and in fail the jumps taken
+ * when = is bound to something else, which must test them all in turn */
+size_t compile_switch_table(um_Compiler* c,
+			    um_Noun clauses,
+			    size_t* exits,
+			    bool tail,
+			    size_t* miss,
+			    size_t* fail) {
+	um_Code* code = c->code.value.code;
+	um_Noun table, key, eq = intern("="), fn, guards = nil;
+	size_t n = 0;
+
+	*miss = *fail = 0;
+	if (!compile_literal_key(car(clauses), &key)
+	    || !compile_global(c, eq, &fn) || fn.type != builtin_t
+	    || fn.value.builtin != builtin_eq) {
+		return 0;
+	}
+
+	if (fn.mut) { compile_guard(&guards, eq, fn); }
+	*fail = compile_guards(c, guards);
+	table = new_table(8);
+	compile_emit(c, OP_SWITCH, compile_constant(c, table), 0);
+	*miss = compile_emit(c, OP_JUMP, 0, 0);
+
+	for (; clauses.type == pair_t && compile_literal_key(car(clauses), &key);
+	     clauses = cdr(clauses), n++) {
+		/* Only the first of equal keys is ever reached */
+		if (table_get(table.value.table, key)) { continue; }
+
+		table_add(table.value.table, key, new_integer(code->size));
+		compile_emit(c, OP_POP, 0, -1);
+		compile_expr(c, compile_clause_body(car(clauses)), tail);
+		*exits = compile_emit(c, OP_JUMP, *exits, -1);
+		c->depth++;
+	}
+
+	return n;
+}
+
+/* cond, switch and match try each clause in turn, testing the clause itself,
+ * (= clause subject) and (clause 'subject) respectively, and evaluate to the
+ * first form after the test that passes. switch evaluates its subject once and
+ * keeps it on the stack beneath each test */
+void compile_clauses(um_Compiler* c, um_Noun op, um_Noun args, bool tail) {
+	um_Code* code = c->code.value.code;
+	bool is_switch = op.value.symbol == sym_switch.value.symbol;
+	bool is_match = op.value.symbol == sym_match.value.symbol;
+	um_Noun subject = nil, clause, test, body;
+	size_t exits = 0, next, patch, miss = 0, fail = 0, i, n = 0;
+
+	if (is_switch || is_match) {
+		if (args.type != pair_t || cdr(args).type != pair_t) {
+			compile_push(c, nil);
+			return;
+		}
+
+		subject = car(args);
+		args = cdr(args);
+	}
+
+	if (is_switch) {
+		compile_expr(c, subject, false);
+		n = compile_switch_table(c, args, &exits, tail, &miss, &fail);
+	}
+
+	/* Without a guard to fail the clauses in the table are never tested */
+	if (!fail) {
+		for (; n > 0; n--) { args = cdr(args); }
+	}
+
+	compile_patch(c, fail);
+	for (i = 0; args.type == pair_t; args = cdr(args), i++) {
+		if (i == n) { compile_patch(c, miss); }
+
+		clause = car(args);
+		test = clause.type == pair_t ? car(clause) : nil;
+		body = compile_clause_body(clause);
+
+		if (is_switch) {
+			compile_lookup(c, intern("="));
+			compile_expr(c, test, false);
+			compile_emit(c, OP_PICK, 3, 1);
+			compile_emit(c, OP_CALL, 2, -2);
+		} else if (is_match) {
+			compile_expr(c, test, false);
+			compile_push(c, subject);
+			compile_emit(c, OP_CALL, 1, -1);
+		} else {
+			compile_expr(c, test, false);
+		}
+
+		next = compile_emit(c, OP_JUMP_FALSE, 0, -1);
+		if (is_switch) { compile_emit(c, OP_POP, 0, -1); }
+		compile_expr(c, body, tail);
+		exits = compile_emit(c, OP_JUMP, exits, -1);
+		code->ops[next] = code->size;
+
+		/* The subject is still there for the next clause */
+		if (is_switch) { c->depth++; }
+	}
+
+	if (i <= n) { compile_patch(c, miss); }
+	if (is_switch) { compile_emit(c, OP_POP, 0, -1); }
+	compile_push(c, nil);
+
+	while (exits) {
+		patch = code->ops[exits];
+		code->ops[exits] = code->size;
+		exits = patch;
+	}
+}
+
+/* def, set, const and defun all bind a name to either a value or, given
+ * (name . args), a function, in which case they evaluate to the name */
+void compile_binding(um_Compiler* c, um_BindKind kind, um_Noun args) {
+	um_Noun sym;
+
+	if (isnil(args) || isnil(cdr(args))) {
+		compile_fail(c, ERROR_ARGS);
+		return;
+	}
+
+	sym = car(args);
+	if (kind == BIND_SET && sym.type != noun_t) {
+		compile_fail(c, ERROR_UNBOUND);
+	} else if (sym.type == pair_t) {
+		if (car(sym).type != noun_t) {
+			compile_fail(c, ERROR_TYPE);
+			return;
+		}
+
+		compile_lambda(c, cdr(sym), cdr(args));
+		compile_store(c, kind, car(sym));
+		compile_emit(c, OP_POP, 0, -1);
+		compile_push(c, car(sym));
+	} else if (sym.type == noun_t) {
+		compile_expr(c, car(cdr(args)), false);
+		compile_store(c, kind, sym);
+	} else {
+		compile_fail(c, ERROR_TYPE);
+	}
+}
+
+/* Evaluates to the last of exprs, nil if there are none */
+void compile_sequence(um_Compiler* c, um_Noun exprs, bool tail) {
+	if (isnil(exprs)) { compile_push(c, nil); }
+
+	for (; !isnil(exprs); exprs = cdr(exprs)) {
+		compile_expr(c, car(exprs), tail && isnil(cdr(exprs)));
+		if (!isnil(cdr(exprs))) { compile_emit(c, OP_POP, 0, -1); }
+	}
+}
+
+void compile_mark(um_Compiler* c, um_Mark* m) {
+	m->size = c->code.value.code->size;
+	m->depth = c->depth;
+	m->shared = c->scope->shared;
+	m->heap = c->scope->code->heap;
+}
+
+/* Drops the code compiled since m, the slots added since being left unused */
+void compile_rewind(um_Compiler* c, um_Mark* m) {
+	c->code.value.code->size = m->size;
+	c->depth = m->depth;
+	c->scope->shared = m->shared;
+	c->scope->code->heap = m->heap;
+}
+
+/* Whether a function made since the slots from first on were added uses one
+ * of them, which a loop around them would then share between iterations.
+ * Within a named let looping in place it is the named let that starts over */
+bool compile_shared(um_Compiler* c, size_t first) {
+	return !c->loop && c->scope->shared > first;
+}
+
+/* Brings the slots from first on into scope under names */
+void compile_let_names(um_Code* code, size_t first, um_Noun names) {
+	for (; !isnil(names); names = cdr(names)) {
+		code->locals[first++] = car(names);
+	}
+}
+
+/* Pops the value on top of the stack into slot i */
+void compile_let_store(um_Compiler* c, size_t i) {
+	compile_emit(c, OP_STORE_LOCAL, BIND_LET << 24 | i, 0);
+	compile_emit(c, OP_POP, 0, -1);
+}
+
+/* Whether sym occurs anywhere in expr */
+bool compile_mentions(um_Noun expr, um_Noun sym) {
+	for (; expr.type == pair_t; expr = cdr(expr)) {
+		if (compile_mentions(car(expr), sym)) { return true; }
+	}
+
+	return expr.type == noun_t && expr.value.symbol == sym.value.symbol;
+}
+
+bool compile_loop_tail(um_Noun names, um_Noun expr, bool tail);
+
+bool compile_loop_args(um_Noun names, um_Noun exprs) {
+	for (; exprs.type == pair_t; exprs = cdr(exprs)) {
+		if (!compile_loop_tail(names, car(exprs), false)) {
+			return false;
+		}
+	}
+
+	return compile_loop_tail(names, exprs, false);
+}
+
+bool compile_loop_body(um_Noun names, um_Noun exprs, bool tail) {
+	for (; exprs.type == pair_t; exprs = cdr(exprs)) {
+		if (!compile_loop_tail(
+			names, car(exprs), tail && isnil(cdr(exprs)))) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/* Whether a named let can loop in place: every use of its name, the first of
+ * names, in expr is a call in tail position of its body, and no function
+ * made in expr refers to any of names, as the loop updates its variables
+ * rather than binding them afresh */
+bool compile_loop_tail(um_Noun names, um_Noun expr, bool tail) {
+	um_Noun name = car(names), op, args, p;
+
+	if (expr.type == noun_t) {
+		return expr.value.symbol != name.value.symbol;
+	} else if (expr.type != pair_t) {
+		return true;
+	}
+
+	op = car(expr);
+	args = cdr(expr);
+	if (op.type != noun_t || !listp(args)) {
+		return compile_loop_args(names, expr);
+	} else if (op.value.symbol == sym_quote.value.symbol) {
+		return true;
+	} else if (op.value.symbol == name.value.symbol) {
+		return tail && compile_loop_args(names, args);
+	} else if (op.value.symbol == sym_fn.value.symbol
+		   || op.value.symbol == intern("\\").value.symbol
+		   || op.value.symbol == sym_defun.value.symbol
+		   || op.value.symbol == sym_mac.value.symbol) {
+		for (p = names; !isnil(p); p = cdr(p)) {
+			if (compile_mentions(args, car(p))) { return false; }
+		}
+
+		return true;
+	} else if (op.value.symbol == sym_if.value.symbol) {
+		/* Tests and branches alternate, a last one being the else */
+		for (p = args; !isnil(p); p = cdr(cdr(p))) {
+			if (isnil(cdr(p))) {
+				return compile_loop_tail(names, car(p), tail);
+			}
+
+			if (!compile_loop_tail(names, car(p), false)
+			    || !compile_loop_tail(names, car(cdr(p)), tail)) {
+				return false;
+			}
+		}
+
+		return true;
+	} else if (op.value.symbol == sym_do.value.symbol) {
+		return compile_loop_body(names, args, tail);
+	} else if (op.value.symbol == sym_cond.value.symbol) {
+		for (p = args; !isnil(p); p = cdr(p)) {
+			if (car(p).type != pair_t || !listp(car(p))) {
+				if (!compile_loop_tail(names, car(p), false)) {
+					return false;
+				}
+			} else if (!compile_loop_tail(names, car(car(p)), false)
+				   || !compile_loop_body(
+				       names, cdr(car(p)), tail)) {
+				return false;
+			}
+		}
+
+		return true;
+	} else if ((op.value.symbol == sym_let.value.symbol
+		    || op.value.symbol == sym_let_star.value.symbol
+		    || op.value.symbol == sym_letrec.value.symbol)
+		   && !isnil(args) && listp(car(args))) {
+		return compile_loop_args(names, car(args))
+		    && compile_loop_body(names, cdr(args), tail);
+	}
+
+	return compile_loop_args(names, expr);
+}
+
+/* A call of the loop being compiled, in tail position of its body */
+void compile_loop_jump(um_Compiler* c, um_Noun args) {
+	um_Loop* loop = c->loop;
+	size_t i = 0;
+
+	for (; !isnil(args); args = cdr(args), i++) {
+		compile_expr(c, car(args), false);
+	}
+
+	if (i > loop->size) {
+		for (; i > 0; i--) { compile_emit(c, OP_POP, 0, -1); }
+		compile_fail(c, ERROR_ARGS);
+		return;
+	}
+
+	for (; i < loop->size; i++) { compile_push(c, nil); }
+	for (; i > 0; i--) { compile_let_store(c, loop->first + i - 1); }
+
+	/* Counted as the value of the call, which never comes */
+	compile_emit(c, OP_JUMP, loop->start, 1);
+}
+
+/* (let name ((var value) ...) body ...) binds the vars as let does and runs
+ * the body, in which (name arg ...) runs it again with the vars bound to the
+ * args. When that can loop in place the body reuses the vars' slots, else
+ * name is a function */
+void compile_named_let(um_Compiler* c, um_Noun args, bool tail) {
+	um_Noun p, b, names, values = nil, vars = nil;
+	um_Loop loop, *outer = c->loop;
+	um_Mark mark;
+	size_t i;
+
+	loop.name = car(args);
+	args = cdr(args);
+	if (isnil(args) || !listp(car(args)) || !listp(cdr(args))) {
+		compile_fail(c, ERROR_ARGS);
+		return;
+	}
+
+	for (p = car(args), loop.size = 0; !isnil(p); p = cdr(p), loop.size++) {
+		b = car(p);
+		if (b.type != pair_t || car(b).type != noun_t
+		    || !listp(cdr(b))) {
+			compile_fail(c, ERROR_SYNTAX);
+			return;
+		}
+
+		vars = cons(car(b), vars);
+		values = cons(isnil(cdr(b)) ? nil : car(cdr(b)), values);
+	}
+
+	vars = reverse_list(vars);
+	values = reverse_list(values);
+	names = cons(loop.name, vars);
+	if (!c->scope || !compile_loop_body(names, cdr(args), true)
+	    || !compile_loop_args(names, values)) {
+		goto function;
+	}
+
+	compile_mark(c, &mark);
+	loop.first = c->scope->code->locals_size;
+	for (i = 0; i < loop.size; i++) {
+		compile_slot(c->scope->code, sym_out_of_scope);
+	}
+
+	for (p = values; !isnil(p); p = cdr(p)) {
+		compile_expr(c, car(p), false);
+	}
+
+	compile_let_names(c->scope->code, loop.first, vars);
+	for (i = loop.size; i > 0; i--) {
+		compile_let_store(c, loop.first + i - 1);
+	}
+
+	loop.start = c->code.value.code->size;
+	c->loop = &loop;
+	c->loops++;
+	compile_sequence(c, cdr(args), tail);
+	c->loops--;
+	c->loop = outer;
+	for (i = 0; i < loop.size; i++) {
+		c->scope->code->locals[loop.first + i] = sym_out_of_scope;
+	}
+
+	/* A function made in the body uses a binding made in it, which every
+	 * run of the body needs afresh */
+	if (!compile_shared(c, loop.first)) { return; }
+	compile_rewind(c, &mark);
+
+function:
+	/* ((letrec ((name (lambda vars body ...))) name) value ...) */
+	p = cons(sym_fn, cons(vars, cdr(args)));
+	p = cons(cons(loop.name, cons(p, nil)), nil);
+	p = cons(sym_letrec, cons(p, cons(loop.name, nil)));
+	compile_expr(c, cons(p, values), tail);
+}
+
+/* (while test body ...) runs the body for as long as test holds, jumping
+ * back within the frame it is in, and evaluates to nil */
+void compile_while(um_Compiler* c, um_Noun args) {
+	um_Code* code = c->code.value.code;
+	size_t start = code->size, exit;
+
+	if (isnil(args) || !listp(args)) {
+		compile_fail(c, ERROR_ARGS);
+		return;
+	}
+
+	c->loops++;
+	compile_expr(c, car(args), false);
+	exit = compile_emit(c, OP_JUMP_FALSE, 0, -1);
+	for (args = cdr(args); !isnil(args); args = cdr(args)) {
+		compile_expr(c, car(args), false);
+		compile_emit(c, OP_POP, 0, -1);
+	}
+
+	c->loops--;
+	compile_emit(c, OP_JUMP, start, 0);
+	code->ops[exit] = code->size;
+	compile_push(c, nil);
+}
+
+/* (dotimes (var count result) body ...) runs the body with var bound to
+ * each integer from 0 up to count, which is evaluated once, then evaluates
+ * to result, or nil without one. var and count live in slots of the
+ * function being compiled, compared and stepped by the builtins themselves
+ * whatever < and + are bound to. When a function made in the body uses var
+ * the body is a function of var instead, called with each integer */
+void compile_dotimes(um_Compiler* c, um_Noun args, bool tail) {
+	um_Code* code = c->code.value.code;
+	um_Noun spec, p;
+	um_Mark mark;
+	size_t first, start, exit;
+	bool fresh = false;
+
+	if (isnil(args) || !listp(args)) {
+		compile_fail(c, ERROR_ARGS);
+		return;
+	}
+
+	spec = car(args);
+	if (spec.type != pair_t || !listp(spec) || car(spec).type != noun_t
+	    || cdr(spec).type != pair_t
+	    || (!isnil(cdr(cdr(spec))) && !isnil(cdr(cdr(cdr(spec)))))) {
+		compile_fail(c, ERROR_SYNTAX);
+		return;
+	}
+
+	if (!c->scope) {
+		compile_lambda(c, nil, cons(cons(sym_dotimes, args), nil));
+		compile_emit(c, tail ? OP_TAIL_CALL : OP_CALL, 0, 0);
+		return;
+	}
+
+	compile_mark(c, &mark);
+
+again:
+	first = c->scope->code->locals_size;
+	compile_slot(c->scope->code, sym_out_of_scope);
+	compile_slot(c->scope->code, sym_out_of_scope);
+
+	compile_expr(c, car(cdr(spec)), false);
+	compile_let_store(c, first + 1);
+	compile_push(c, new_integer(0));
+	c->scope->code->locals[first] = car(spec);
+	compile_let_store(c, first);
+
+	start = code->size;
+	compile_push(c, new_builtin(builtin_less));
+	compile_emit(c, OP_LOCAL, first, 1);
+	compile_emit(c, OP_LOCAL, first + 1, 1);
+	compile_emit(c, OP_CALL, 2, -2);
+	exit = compile_emit(c, OP_JUMP_FALSE, 0, -1);
+	if (fresh) {
+		compile_lambda(c, cons(car(spec), nil), cdr(args));
+		compile_emit(c, OP_LOCAL, first, 1);
+		compile_emit(c, OP_CALL, 1, -1);
+		compile_emit(c, OP_POP, 0, -1);
+	} else {
+		c->loops++;
+		for (p = cdr(args); !isnil(p); p = cdr(p)) {
+			compile_expr(c, car(p), false);
+			compile_emit(c, OP_POP, 0, -1);
+		}
+
+		c->loops--;
+		if (compile_shared(c, first)) {
+			c->scope->code->locals[first] = sym_out_of_scope;
+			compile_rewind(c, &mark);
+			fresh = true;
+			goto again;
+		}
+	}
+
+	compile_push(c, new_builtin(builtin_add));
+	compile_emit(c, OP_LOCAL, first, 1);
+	compile_push(c, new_integer(1));
+	compile_emit(c, OP_CALL, 2, -2);
+	compile_let_store(c, first);
+	compile_emit(c, OP_JUMP, start, 0);
+	code->ops[exit] = code->size;
+
+	if (isnil(cdr(cdr(spec)))) {
+		compile_push(c, nil);
+	} else {
+		compile_expr(c, car(cdr(cdr(spec))), tail);
+	}
+
+	c->scope->code->locals[first] = sym_out_of_scope;
+	c->scope->code->locals[first + 1] = sym_out_of_scope;
+}
+
+/* let binds each name to a slot of the function being compiled, seen only by
+ * the body, once all values are evaluated. let* binds each name before
+ * evaluating the next value and letrec binds them all before the first. At
+ * the top level, or when a name of let destructures its value, this is the
+ * lambda application let used to stand for. In a loop whose body a function
+ * made in it uses the names from, it runs in a function of its own, for each
+ * iteration to bind them afresh */
+void compile_let(um_Compiler* c, um_Noun op, um_Noun args, bool tail) {
+	um_Noun p, b, names = nil, values = nil;
+	um_Mark mark;
+	size_t first, i, n = 0;
+	bool plain = true;
+
+	if (op.value.symbol == sym_let.value.symbol && args.type == pair_t
+	    && car(args).type == noun_t) {
+		compile_named_let(c, args, tail);
+		return;
+	}
+
+	if (isnil(args) || !listp(car(args)) || !listp(cdr(args))) {
+		compile_fail(c, ERROR_ARGS);
+		return;
+	}
+
+	for (p = car(args); !isnil(p); p = cdr(p), n++) {
+		b = car(p);
+		if (b.type != pair_t || !listp(cdr(b))) {
+			compile_fail(c, ERROR_SYNTAX);
+			return;
+		}
+
+		plain = plain && car(b).type == noun_t;
+		names = cons(car(b), names);
+		values = cons(isnil(cdr(b)) ? nil : car(cdr(b)), values);
+	}
+
+	names = reverse_list(names);
+	values = reverse_list(values);
+	if (!c->scope) {
+		goto function;
+	} else if (!plain && op.value.symbol == sym_letrec.value.symbol) {
+		compile_fail(c, ERROR_TYPE);
+		return;
+	} else if (!plain && op.value.symbol == sym_let_star.value.symbol) {
+		/* Nests a let for each binding, only one of which need be an
+		 * application */
+		p = cdr(args);
+		if (!isnil(cdr(car(args)))) {
+			p = cons(sym_let_star, cons(cdr(car(args)), p));
+			p = cons(p, nil);
+		}
+
+		compile_expr(
+		    c, cons(sym_let, cons(cons(car(car(args)), nil), p)), tail);
+		return;
+	} else if (!plain) {
+		compile_lambda(c, names, cdr(args));
+		for (; !isnil(values); values = cdr(values)) {
+			compile_expr(c, car(values), false);
+		}
+
+		compile_emit(c, tail ? OP_TAIL_CALL : OP_CALL, n, -(int)n);
+		return;
+	}
+
+	/* The slots are out of scope until their names are bound */
+	compile_mark(c, &mark);
+	first = c->scope->code->locals_size;
+	for (i = 0; i < n; i++) {
+		compile_slot(c->scope->code, sym_out_of_scope);
+	}
+
+	if (op.value.symbol == sym_letrec.value.symbol) {
+		compile_let_names(c->scope->code, first, names);
+	}
+
+	for (i = 0, p = names; i < n; i++, p = cdr(p), values = cdr(values)) {
+		compile_expr(c, car(values), false);
+		if (op.value.symbol != sym_let.value.symbol) {
+			c->scope->code->locals[first + i] = car(p);
+			compile_let_store(c, first + i);
+		}
+	}
+
+	if (op.value.symbol == sym_let.value.symbol) {
+		compile_let_names(c->scope->code, first, names);
+		for (i = n; i > 0; i--) { compile_let_store(c, first + i - 1); }
+	}
+
+	compile_sequence(c, cdr(args), tail);
+	for (i = 0; i < n; i++) {
+		c->scope->code->locals[first + i] = sym_out_of_scope;
+	}
+
+	if (!c->loops || !compile_shared(c, first)) { return; }
+	compile_rewind(c, &mark);
+
+function:
+	compile_lambda(c, nil, cons(cons(op, args), nil));
+	compile_emit(c, tail ? OP_TAIL_CALL : OP_CALL, 0, 0);
+}
+
+void compile_expr(um_Compiler* c, um_Noun expr, bool tail) {
+	if (um_nest == UM_NEST_MAX) {
+		compile_fail(c, ERROR_STACK);
+		return;
+	}
+
+	um_nest++;
+	compile_form(c, expr, tail);
+	um_nest--;
+}
+
+/* A call of op on args, each evaluated in turn */
+void compile_call(um_Compiler* c, um_Noun op, um_Noun args, bool tail) {
+	um_Noun p;
+	size_t argc = 0;
+
+	if (op.type == noun_t && compile_qualified(c, op, args)) { return; }
+
+	compile_expr(c, op, false);
+	for (p = args; p.type == pair_t; p = cdr(p), argc++) {
+		compile_expr(c, car(p), false);
+	}
+
+	if (!isnil(p)) {
+		compile_fail(c, ERROR_SYNTAX);
+		return;
+	}
+
+	compile_emit(c, tail ? OP_TAIL_CALL : OP_CALL, argc, -(int)argc);
+}
+
+void compile_form(um_Compiler* c, um_Noun expr, bool tail) {
+	um_Noun op, args, value, guards = nil;
+	size_t fail, done;
+
+	if (expr.type == noun_t) {
+		if (compile_fold(c, expr, &value, &guards)) {
+			compile_push(c, value);
+		} else {
+			compile_lookup(c, expr);
+		}
+
+		return;
+	} else if (expr.type != pair_t) {
+		compile_push(c, expr);
+		return;
+	}
+
+	op = car(expr);
+	args = cdr(expr);
+
+	if (op.type == noun_t) {
+		if (op.value.symbol == sym_if.value.symbol) {
+			compile_if(c, args, tail);
+			return;
+		} else if (op.value.symbol == sym_cond.value.symbol
+			   || op.value.symbol == sym_match.value.symbol
+			   || op.value.symbol == sym_switch.value.symbol) {
+			compile_clauses(c, op, args, tail);
+			return;
+		} else if (op.value.symbol == sym_set.value.symbol) {
+			compile_binding(c, BIND_SET, args);
+			return;
+		} else if (op.value.symbol == sym_def.value.symbol) {
+			compile_binding(c, BIND_DEF, args);
+			return;
+		} else if (op.value.symbol == sym_const.value.symbol) {
+			compile_binding(c, BIND_CONST, args);
+			return;
+		} else if (op.value.symbol == sym_defun.value.symbol) {
+			if (isnil(args) || isnil(cdr(args))
+			    || isnil(cdr(cdr(args)))) {
+				compile_fail(c, ERROR_ARGS);
+			} else if (car(args).type != noun_t
+				   || car(cdr(args)).type != pair_t
+				   || cdr(cdr(args)).type != pair_t) {
+				compile_fail(c, ERROR_TYPE);
+			} else {
+				compile_binding(
+				    c,
+				    BIND_DEFUN,
+				    cons(cons(car(args), car(cdr(args))),
+					 cdr(cdr(args))));
+			}
+
+			return;
+		} else if (op.value.symbol == sym_quote.value.symbol) {
+			if (isnil(args) || !isnil(cdr(args))) {
+				compile_fail(c, ERROR_ARGS);
+			} else {
+				compile_push(c, car(args));
+			}
+
+			return;
+		} else if (op.value.symbol == sym_fn.value.symbol
+			   || op.value.symbol == intern("\\").value.symbol) {
+			if (isnil(args) || isnil(cdr(args))) {
+				compile_fail(c, ERROR_ARGS);
+			} else {
+				compile_lambda(c, car(args), cdr(args));
+			}
+
+			return;
+		} else if (op.value.symbol == sym_do.value.symbol) {
+			compile_sequence(c, args, tail);
+			return;
+		} else if (op.value.symbol == sym_let.value.symbol
+			   || op.value.symbol == sym_let_star.value.symbol
+			   || op.value.symbol == sym_letrec.value.symbol) {
+			compile_let(c, op, args, tail);
+			return;
+		} else if (op.value.symbol == sym_while.value.symbol) {
+			compile_while(c, args);
+			return;
+		} else if (op.value.symbol == sym_dotimes.value.symbol) {
+			compile_dotimes(c, args, tail);
+			return;
+		} else if (c->loop
+			   && op.value.symbol == c->loop->name.value.symbol) {
+			compile_loop_jump(c, args);
+			return;
+		} else if (op.value.symbol == sym_mac.value.symbol) {
+			if (isnil(args) || isnil(cdr(args))
+			    || isnil(cdr(cdr(args)))) {
+				compile_fail(c, ERROR_ARGS);
+			} else if (car(args).type != noun_t) {
+				compile_fail(c, ERROR_TYPE);
+			} else {
+				compile_lambda(c, car(cdr(args)), cdr(cdr(args)));
+				compile_store(c, BIND_MAC, car(args));
+				compile_emit(c, OP_POP, 0, -1);
+				compile_push(c, car(args));
+			}
+
+			return;
+		}
+	}
+
+	if (!compile_fold(c, expr, &value, &guards)) {
+		compile_call(c, op, args, tail);
+	} else if (isnil(guards)) {
+		compile_push(c, value);
+	} else {
+		/* The value stands while the builtins it came from are bound */
+		fail = compile_guards(c, guards);
+		compile_push(c, value);
+		done = compile_emit(c, OP_JUMP, 0, -1);
+		compile_patch(c, fail);
+		compile_call(c, op, args, tail);
+		compile_patch(c, done);
+	}
+}
+
+/* Compiles an already macro expanded expression to run at the top level */
+um_Noun compile(um_Noun expr) {
+	um_Compiler c;
+
+	c.code = new_code(nil, nil);
+	c.depth = c.loops = 0;
+	c.scope = NULL;
+	c.loop = NULL;
+	compile_expr(&c, expr, true);
+	compile_emit(&c, OP_RETURN, 0, -1);
+	return c.code;
+}
+
+/* Arithmetic stays exact while both operands are integers, mixed operands and
+ * integer results that would overflow are computed in floating point */
+#define integer_operands(a0, a1) \
+	((a0).type == integer_t && (a1).type == integer_t)
+
+/* An operand as a double, only going through cast when it isn't a number */
+double real_operand(um_Noun a) {
+	return a.type == real_t	     ? a.value.number
+	     : a.type == integer_t ? (double)a.value.integer
+				   : cast(a, real_t).value.number;
+}
+
+um_Noun number_add(um_Noun a0, um_Noun a1) {
+	int64_t r;
+	if (integer_operands(a0, a1)
+	    && !__builtin_add_overflow(a0.value.integer, a1.value.integer, &r)) {
+		return new (r);
+	}
+
+	return new (real_operand(a0) + real_operand(a1));
+}
+
+um_Noun number_subtract(um_Noun a0, um_Noun a1) {
+	int64_t r;
+	if (integer_operands(a0, a1)
+	    && !__builtin_sub_overflow(a0.value.integer, a1.value.integer, &r)) {
+		return new (r);
+	}
+
+	return new (real_operand(a0) - real_operand(a1));
+}
+
+um_Noun number_multiply(um_Noun a0, um_Noun a1) {
+	int64_t r;
+	if (integer_operands(a0, a1)
+	    && !__builtin_mul_overflow(a0.value.integer, a1.value.integer, &r)) {
+		return new (r);
+	}
+
+	return new (real_operand(a0) * real_operand(a1));
+}
+
+/* Integer division is only kept exact when it leaves no remainder */
+um_Noun number_divide(um_Noun a0, um_Noun a1) {
+	if (integer_operands(a0, a1) && a1.value.integer != 0
+	    && !(a0.value.integer == INT64_MIN && a1.value.integer == -1)
+	    && a0.value.integer % a1.value.integer == 0) {
+		return new ((int64_t)(a0.value.integer / a1.value.integer));
+	}
+
+	return new (real_operand(a0) / real_operand(a1));
+}
+
+um_Noun number_less(um_Noun a0, um_Noun a1) {
+	return integer_operands(a0, a1)
+		 ? new ((bool)(a0.value.integer < a1.value.integer))
+		 : new ((bool)(real_operand(a0) < real_operand(a1)));
+}
+
+um_Noun number_greater(um_Noun a0, um_Noun a1) {
+	return integer_operands(a0, a1)
+		 ? new ((bool)(a0.value.integer > a1.value.integer))
+		 : new ((bool)(real_operand(a0) > real_operand(a1)));
+}
+
+/* Calls of these builtins on two numbers are done by the VM itself, without
+ * a vector of arguments. False for anything else, which is really called */
+bool vm_arith(um_Builtin fn, um_Noun a0, um_Noun a1, um_Noun* result) {
+	if (!isnumber(a0) || !isnumber(a1)) { return false; }
+
+	if (fn == builtin_add) {
+		*result = number_add(a0, a1);
+	} else if (fn == builtin_subtract) {
+		*result = number_subtract(a0, a1);
+	} else if (fn == builtin_multiply) {
+		*result = number_multiply(a0, a1);
+	} else if (fn == builtin_divide) {
+		*result = number_divide(a0, a1);
+	} else if (fn == builtin_less) {
+		*result = number_less(a0, a1);
+	} else if (fn == builtin_greater) {
+		*result = number_greater(a0, a1);
+	} else {
+		return false;
+	}
+
+	return true;
+}
+
+bool um_truthy(um_Noun a) {
+	return !isnil(a) && cast(a, bool_t).value.bool_v;
+}
+
+um_Frame* vm_push_frame() {
+	if (vm_frames_size == vm_frames_capacity) {
+		vm_frames_capacity = vm_frames_capacity * 2 + 64;
+		vm_frames = (um_Frame*)realloc(
+		    vm_frames, vm_frames_capacity * sizeof(um_Frame));
+	}
+
+	return &vm_frames[vm_frames_size++];
+}
+
+/* The env enclosing the running function */
+um_Noun vm_outer(um_Frame* f) {
+	return f->code.value.code->heap ? f->env.value.vector_v->data[0]
+					: f->env;
+}
+
+/* Looks sym up by name, first in the heap frames from env outwards, for a
+ * slot that is still unbound in a nearer one, and then in the environment */
+um_Error vm_lookup(um_Noun env, um_Noun sym, um_Noun* result) {
+	um_Vector* v;
+	um_Code* code;
+	size_t i;
+
+	while (env.type == vector_t) {
+		v = env.value.vector_v;
+		code = v->data[1].value.code;
+		i = code_local(code, sym);
+		if (i < code->locals_size && v->data[i + 2].type != unbound_t) {
+			*result = v->data[i + 2];
+			return MakeErrorCode(OK);
+		}
+
+		env = v->data[0];
+	}
+
+	if (env_get(env, sym.value.symbol, result)._) {
+		cur_expr = sym;
+		return MakeErrorCode(ERROR_UNBOUND);
+	}
+
+	return MakeErrorCode(OK);
+}
+
+/* Looks up constant k of the running code, a name bound in the environment
+ * at the root of env. Bindings in a root without a parent never move or go
+ * away, so once found there they are cached for next time, as long as the
+ * code keeps running in the same environment */
+um_Error vm_global(um_Noun code, int32_t k, um_Noun env, um_Noun* result) {
+	um_Code* c = code.value.code;
+	um_TableEntry* e;
+	size_t i;
+
+	while (env.type == vector_t) { env = env.value.vector_v->data[0]; }
+
+	if (c->cells[k] && cdr(env).value.table == c->globals.value.table) {
+		*result = c->cells[k]->v;
+		return MakeErrorCode(OK);
+	}
+
+	if (isnil(car(env))
+	    && (e = table_get_sym(cdr(env).value.table,
+				  c->constants[k].value.symbol))) {
+		if (c->globals.type != table_t
+		    || c->globals.value.table != cdr(env).value.table) {
+			for (i = 0; i < c->constants_size; i++) {
+				if (c->constants[i].type == noun_t) {
+					c->cells[i] = NULL;
+				}
+			}
 
-				if (sym.type == pair_t) {
+			garbage_collector_barrier(code, c->globals, cdr(env));
+			c->globals = cdr(env);
+		}
 
-					err = new_closure(
-					    env, cdr(sym), cdr(args), result);
-					sym = car(sym);
+		c->cells[k] = e;
+		*result = e->v;
+		return MakeErrorCode(OK);
+	}
 
-					if (sym.type != noun_t) {
-						return MakeErrorCode(
-						    ERROR_TYPE);
-					}
+	return vm_lookup(env, c->constants[k], result);
+}
 
-					result->mut = false;
-					err = env_assign_eq(
-					    env, sym.value.symbol, *result);
-					*result = sym;
-					stack_restore_add(ss, *result);
-					return err;
-				} else if (sym.type == noun_t) {
-					err = eval_expr(
-					    car(cdr(args)), env, &val);
-					if (err._) {
-						stack_restore(ss);
-						return err;
-					}
+/* Binds sym wherever it is found from env outwards, defining it in the
+ * environment if that is allowed */
+um_Error vm_assign(um_Noun env, um_Noun sym, um_BindKind kind, um_Noun value) {
+	um_Vector* v;
+	um_Code* code;
+	um_Noun r;
+	size_t i;
 
-					val.mut = false;
-					*result = val;
-					err = env_assign_eq(
-					    env, sym.value.symbol, val);
-					stack_restore_add(ss, *result);
-					return err;
-				} else {
-					stack_restore(ss);
-					return MakeErrorCode(ERROR_TYPE);
-				}
-			} else if (op.value.symbol == sym_defun.value.symbol) {
-				if (isnil(args) || isnil(cdr(args))
-				    || isnil(cdr(cdr(args)))) {
-					stack_restore(ss);
-					return MakeErrorCode(ERROR_ARGS);
-				}
+	while (env.type == vector_t) {
+		v = env.value.vector_v;
+		code = v->data[1].value.code;
+		i = code_local(code, sym);
+		if (i < code->locals_size && v->data[i + 2].type != unbound_t) {
+			if (!v->data[i + 2].mut) {
+				return MakeErrorCode(ERROR_NOMUT);
+			}
+
+			garbage_collector_barrier(env, v->data[i + 2], value);
+			v->data[i + 2] = value;
+			return MakeErrorCode(OK);
+		}
+
+		env = v->data[0];
+	}
 
-				sym = car(args);
+	if (kind == BIND_DEF || kind == BIND_MAC) {
+		return env_assign(env, sym.value.symbol, value);
+	}
 
-				if (sym.type == noun_t
-				    && car(cdr(args)).type == pair_t
-				    && cdr(cdr(args)).type == pair_t) {
+	if (kind == BIND_SET && env_get(env, sym.value.symbol, &r)._) {
+		cur_expr = sym;
+		return MakeErrorCode(ERROR_UNBOUND);
+	}
 
-					err = new_closure(env,
-							  car(cdr(args)),
-							  cdr(cdr(args)),
-							  result);
+	return env_assign_eq(env, sym.value.symbol, value);
+}
 
-					if (sym.type != noun_t) {
-						return MakeErrorCode(
-						    ERROR_TYPE);
-					}
+/* Stores value in slot of frame owner. Only def, mac and let bind a slot that
+ * is still unbound, anything else goes looking for sym further out */
+um_Error vm_store(um_Noun owner,
+		  um_Noun* slot,
+		  um_Noun outer,
+		  um_Noun sym,
+		  um_BindKind kind,
+		  um_Noun value) {
+	if (slot->type == unbound_t && kind != BIND_DEF && kind != BIND_MAC
+	    && kind != BIND_LET) {
+		return vm_assign(outer, sym, kind, value);
+	}
 
-					err = env_assign_eq(
-					    env, sym.value.symbol, *result);
-					*result = sym;
-					stack_restore_add(ss, *result);
-					return err;
-				} else {
-					stack_restore(ss);
-					return MakeErrorCode(ERROR_TYPE);
+	if (slot->type != unbound_t && !slot->mut && kind != BIND_LET) {
+		return MakeErrorCode(ERROR_NOMUT);
+	}
+
+	garbage_collector_barrier(owner, *slot, value);
+	*slot = value;
+	return MakeErrorCode(OK);
+}
+
+um_Error vm_destructure(um_Code* code,
+			um_Noun pattern,
+			um_Noun val,
+			um_Noun* slots) {
+	um_Error err;
+
+	if (isnil(pattern)) {
+		return isnil(val) ? MakeErrorCode(OK)
+				  : MakeErrorCode(ERROR_ARGS);
+	} else if (pattern.type == noun_t) {
+		slots[code_local(code, pattern)] = val;
+		return MakeErrorCode(OK);
+	} else if (pattern.type == pair_t) {
+		if (val.type != pair_t) { return MakeErrorCode(ERROR_ARGS); }
+
+		err = vm_destructure(code, car(pattern), car(val), slots);
+		if (err._) { return err; }
+
+		return vm_destructure(code, cdr(pattern), cdr(val), slots);
+	} else {
+		return MakeErrorCode(ERROR_ARGS);
+	}
+}
+
+/* Binds arguments to parameters which destructure them or take the rest,
+ * missing ones are nil */
+um_Error vm_bind(um_Code* code, um_Vector* v_params, um_Noun* slots) {
+	um_Noun names = code->args;
+	um_Error err;
+	size_t i = 0;
+
+	while (!isnil(names)) {
+		if (names.type == noun_t) {
+			slots[code_local(code, names)]
+			    = vector_to_noun(v_params, i);
+			i = v_params->size;
+			break;
+		}
+
+		err = vm_destructure(
+		    code,
+		    car(names),
+		    i < v_params->size ? v_params->data[i] : nil,
+		    slots);
+		if (err._) { return err; }
+
+		names = cdr(names);
+		i++;
+	}
+
+	if (i < v_params->size) { return MakeErrorCode(ERROR_ARGS); }
+
+	return MakeErrorCode(OK);
+}
+
+/* Reads slot x & 0xffff of the function x >> 16 levels out from f */
+um_Error vm_env(um_Frame* f, int32_t x, um_Noun* result) {
+	um_Noun e = vm_outer(f);
+	um_Vector* w;
+	int32_t d;
+
+	for (d = x >> 16; d > 1; d--) { e = e.value.vector_v->data[0]; }
+
+	w = e.value.vector_v;
+	x &= 0xffff;
+	*result = w->data[x + 2];
+	if (result->type == unbound_t) {
+		return vm_lookup(
+		    w->data[0], w->data[1].value.code->locals[x], result);
+	}
+
+	return MakeErrorCode(OK);
+}
+
+/* What a def, const or mac does to the value it binds */
+void vm_bind_value(int32_t kind, um_Noun* a) {
+	if (kind == BIND_CONST) {
+		a->mut = false;
+	} else if (kind == BIND_MAC) {
+		a->type = macro_t;
+	}
+}
+
+um_Error vm_store_local(um_Frame* f, int32_t x, um_Noun value) {
+	um_Code* code = f->code.value.code;
+	return vm_store(code->heap ? f->env : nil,
+			&f->slots[x & 0xffffff],
+			vm_outer(f),
+			code->locals[x & 0xffffff],
+			x >> 24,
+			value);
+}
+
+um_Error vm_store_env(um_Frame* f, int32_t x, um_Noun value) {
+	um_Noun e = vm_outer(f);
+	um_Vector* w;
+	int32_t d;
+
+	for (d = (x >> 16) & 0xff; d > 1; d--) {
+		e = e.value.vector_v->data[0];
+	}
+
+	w = e.value.vector_v;
+	return vm_store(e,
+			&w->data[(x & 0xffff) + 2],
+			w->data[0],
+			w->data[1].value.code->locals[x & 0xffff],
+			x >> 24,
+			value);
+}
+
+/* Enters closure fn, found on the VM stack below its argc arguments. These
+ * become the first slots of its frame, moved to the heap if need be */
+um_Error vm_enter(um_Noun fn, size_t argc) {
+	um_Noun proto = cdr(cdr(cdr(fn))), frame;
+	um_Code* code = proto.value.code;
+	size_t base = vm_sp - argc, i;
+	um_Noun* slots = vm_stack + base;
+	um_Vector v;
+	um_Error err;
+	um_Frame* f;
+
+	if (base + code->locals_size + code->max_stack > vm_stack_limit) {
+		return MakeErrorCode(ERROR_STACK);
+	}
+
+#ifdef UM_JIT
+	if (!code->jit && ++code->calls == UM_JIT_THRESHOLD) {
+		jit_compile(code);
+	}
+#endif
+
+	if (code->simple) {
+		if (argc > code->params) { return MakeErrorCode(ERROR_ARGS); }
+
+		for (i = argc; i < code->params; i++) { slots[i] = nil; }
+		for (; i < code->locals_size; i++) { slots[i] = um_unbound; }
+	} else {
+		vector_new(&v);
+		for (i = 0; i < argc; i++) { vector_add(&v, slots[i]); }
+		for (i = 0; i < code->locals_size; i++) {
+			slots[i] = um_unbound;
+		}
+
+		err = vm_bind(code, &v, slots);
+		vector_free(&v);
+		if (err._) { return err; }
+	}
+
+	vm_sp = base + code->locals_size;
+	if (code->heap) {
+		frame = new_vector();
+		vector_add(frame.value.vector_v, car(fn));
+		vector_add(frame.value.vector_v, proto);
+		for (i = 0; i < code->locals_size; i++) {
+			vector_add(frame.value.vector_v, slots[i]);
+		}
+
+		vm_sp = base;
+		slots = frame.value.vector_v->data + 2;
+	} else {
+		frame = car(fn);
+	}
+
+	f = vm_push_frame();
+	f->code = proto;
+	f->env = frame;
+	f->slots = slots;
+	f->pc = 0;
+	f->base = base;
+	return MakeErrorCode(OK);
+}
+
+/* Whether the global named by constant k of f's code is still bound to the
+ * builtin after it */
+bool vm_check(um_Frame* f, int32_t k) {
+	um_Code* c = f->code.value.code;
+	um_Noun fn;
+
+	return !vm_global(f->code, k, f->env, &fn)._ && fn.type == builtin_t
+	    && fn.value.builtin == c->constants[k + 1].value.builtin;
+}
+
+/* Where the clause keyed by subject starts, or -1 to try the rest in turn.
+ * Keys are only ever numbers, strings and symbols */
+int32_t vm_switch(um_Noun table, um_Noun subject) {
+	um_TableEntry* e;
+
+	if (!isnumber(subject) && subject.type != noun_t
+	    && subject.type != string_t) {
+		return -1;
+	}
+
+	e = table_get(table.value.table, subject);
+	return e ? (int32_t)e->v.value.integer : -1;
+}
+
+/* Everything the VM itself still needs is on its stack or in its frames, so
+ * anything allocated since it was entered can be dropped from the root stack
+ * and the collector given a chance to run */
+void vm_safe_point(size_t mark) {
+	stack_size = mark;
+	garbage_collector_consider();
+}
+
+#ifdef UM_JIT
+/* A function entered UM_JIT_THRESHOLD times is compiled to x86-64. Each op
+ * becomes a short run of machine code keeping the VM stack pointer in rbx, the
+ * frame's slots in r12, the state below in r13 and the constants and cells in
+ * r14 and r15. Loads, jumps and integer or float arithmetic on +, -, *, <, >
+ * and = run inline behind guards on the callee and operand types, anything
+ * else calls into the same C the interpreter uses. When a guard fails the op
+ * is done the generic way; what the machine code leaves to the interpreter,
+ * calls to closures and returns above all, hands it the frame back at that op
+ * with nothing yet done, and the VM goes back in once the frame runs again */
+typedef struct {
+	um_Noun* sp;
+	um_Noun* slots;
+	void* target;
+	um_Table* root;
+	size_t frame, mark;
+	int32_t pc;
+	um_Error err;
+} um_JitState;
+
+/* What helpers called from machine code return, JIT_EXIT leaving the op they
+ * were called for to the interpreter */
+typedef enum { JIT_OK, JIT_EXIT, JIT_ERROR } um_JitStatus;
+typedef int (*um_JitHelper)(um_JitState* s, int32_t x);
+
+typedef struct {
+	unsigned char* data;
+	size_t size, capacity;
+	size_t* fixups;
+	size_t fixups_size, fixups_capacity;
+	size_t epilogue;
+} um_Jit;
+
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R12 = 12, R13, R14, R15 };
+
+int jit_local(um_JitState* s, int32_t x) {
+	um_Frame* f = &vm_frames[s->frame];
+	*s->sp = s->slots[x];
+	if (s->sp->type == unbound_t
+	    && vm_lookup(vm_outer(f), f->code.value.code->locals[x], s->sp)._) {
+		return JIT_EXIT;
+	}
+
+	s->sp++;
+	return JIT_OK;
+}
+
+int jit_env(um_JitState* s, int32_t x) {
+	if (vm_env(&vm_frames[s->frame], x, s->sp)._) { return JIT_EXIT; }
+
+	s->sp++;
+	return JIT_OK;
+}
+
+int jit_global(um_JitState* s, int32_t x) {
+	um_Frame* f = &vm_frames[s->frame];
+	if (vm_global(f->code, x, f->env, s->sp)._) { return JIT_EXIT; }
+
+	s->sp++;
+	return JIT_OK;
+}
+
+int jit_check(um_JitState* s, int32_t x) {
+	*s->sp++ = new_bool(vm_check(&vm_frames[s->frame], x));
+	return JIT_OK;
+}
+
+int jit_closure(um_JitState* s, int32_t x) {
+	um_Frame* f = &vm_frames[s->frame];
+	*s->sp++ = new_closure(f->env, f->code.value.code->constants[x]);
+	return JIT_OK;
+}
+
+int jit_switch(um_JitState* s, int32_t x) {
+	um_Code* code = vm_frames[s->frame].code.value.code;
+	x = vm_switch(code->constants[x], s->sp[-1]);
+	s->target = x >= 0 ? code->jit + code->jit_map[x / 2] : NULL;
+	return JIT_OK;
+}
+
+int jit_store_local(um_JitState* s, int32_t x) {
+	vm_bind_value(x >> 24, &s->sp[-1]);
+	s->err = vm_store_local(&vm_frames[s->frame], x, s->sp[-1]);
+	return s->err._ ? JIT_ERROR : JIT_OK;
+}
+
+int jit_store_env(um_JitState* s, int32_t x) {
+	vm_bind_value(x >> 24, &s->sp[-1]);
+	s->err = vm_store_env(&vm_frames[s->frame], x, s->sp[-1]);
+	return s->err._ ? JIT_ERROR : JIT_OK;
+}
+
+int jit_store_global(um_JitState* s, int32_t x) {
+	um_Frame* f = &vm_frames[s->frame];
+	vm_bind_value(x >> 24, &s->sp[-1]);
+	s->err = vm_assign(f->env,
+			   f->code.value.code->constants[x & 0xffffff],
+			   x >> 24,
+			   s->sp[-1]);
+	return s->err._ ? JIT_ERROR : JIT_OK;
+}
+
+/* Only builtins are called from machine code, apply included for it would
+ * rather be a tail call */
+int jit_call(um_JitState* s, int32_t x) {
+	um_Noun fn = s->sp[-x - 1], r;
+	um_Vector v;
+
+	if (fn.type != builtin_t || !fn.value.builtin
+	    || fn.value.builtin == builtin_apply) {
+		return JIT_EXIT;
+	}
+
+	if (x == 2 && vm_arith(fn.value.builtin, s->sp[-2], s->sp[-1], &r)) {
+		s->sp -= 3;
+		*s->sp++ = r;
+		return JIT_OK;
+	}
+
+	vm_sp = s->sp - vm_stack;
+	v.data = s->sp - x;
+	v.size = v.capacity = x;
+	s->err = fn.value.builtin(&v, &r);
+	if (s->err._) { return JIT_ERROR; }
+
+	s->sp -= x + 1;
+	*s->sp++ = r;
+	vm_sp = s->sp - vm_stack;
+	vm_safe_point(s->mark);
+	return JIT_OK;
+}
+
+int jit_truthy(um_Noun* a) {
+	return um_truthy(*a);
+}
+
+void jit_byte(um_Jit* j, int b) {
+	if (j->size == j->capacity) {
+		j->capacity = j->capacity * 2 + 256;
+		j->data = (unsigned char*)realloc(j->data, j->capacity);
+	}
+
+	j->data[j->size++] = (unsigned char)b;
+}
+
+void jit_u32(um_Jit* j, uint32_t v) {
+	int i;
+	for (i = 0; i < 4; i++) { jit_byte(j, (v >> (i * 8)) & 0xff); }
+}
+
+void jit_u64(um_Jit* j, uint64_t v) {
+	jit_u32(j, (uint32_t)v);
+	jit_u32(j, (uint32_t)(v >> 32));
+}
+
+void jit_rex(um_Jit* j, bool w, int reg, int base) {
+	if (w || reg >= 8 || base >= 8) {
+		jit_byte(j, 0x40 | w << 3 | (reg >= 8) << 2 | (base >= 8));
+	}
+}
+
+/* Emits op, with an optional prefix and 0x0f escape in its high byte, taking
+ * reg and [base + disp] */
+void jit_mem(
+    um_Jit* j, int prefix, bool w, int op, int reg, int base, int32_t disp) {
+	if (prefix) { jit_byte(j, prefix); }
+	jit_rex(j, w, reg, base);
+	if (op > 0xff) { jit_byte(j, op >> 8); }
+	jit_byte(j, op & 0xff);
+	jit_byte(j, 0x80 | (reg & 7) << 3 | (base & 7));
+	if ((base & 7) == RSP) { jit_byte(j, 0x24); }
+	jit_u32(j, (uint32_t)disp);
+}
+
+/* Register to register, op reg, rm */
+void jit_reg(um_Jit* j, bool w, int op, int reg, int rm) {
+	jit_rex(j, w, reg, rm);
+	if (op > 0xff) { jit_byte(j, op >> 8); }
+	jit_byte(j, op & 0xff);
+	jit_byte(j, 0xc0 | (reg & 7) << 3 | (rm & 7));
+}
+
+void jit_mov_imm(um_Jit* j, int reg, uint64_t v) {
+	jit_rex(j, true, 0, reg);
+	jit_byte(j, 0xb8 | (reg & 7));
+	jit_u64(j, v);
+}
+
+/* add or sub (ext 0 or 5) of an immediate to a register */
+void jit_arith_imm(um_Jit* j, int ext, int reg, int32_t v) {
+	jit_rex(j, true, 0, reg);
+	jit_byte(j, 0x81);
+	jit_byte(j, 0xc0 | ext << 3 | (reg & 7));
+	jit_u32(j, (uint32_t)v);
+}
+
+/* cmp dword [base + disp], v */
+void jit_cmp_type(um_Jit* j, int base, int32_t disp, int32_t v) {
+	jit_mem(j, 0, false, 0x81, 7, base, disp);
+	jit_u32(j, (uint32_t)v);
+}
+
+/* Emits a jump with a 32 bit displacement, returning where that is */
+size_t jit_jump(um_Jit* j, int cc) {
+	if (cc < 0) {
+		jit_byte(j, 0xe9);
+	} else {
+		jit_byte(j, 0x0f);
+		jit_byte(j, 0x80 | cc);
+	}
+
+	jit_u32(j, 0);
+	return j->size - 4;
+}
+
+void jit_patch(um_Jit* j, size_t at, size_t to) {
+	uint32_t rel = (uint32_t)(to - (at + 4));
+	memcpy(j->data + at, &rel, 4);
+}
+
+/* A jump to the op at pc, patched once every op has been emitted */
+void jit_jump_op(um_Jit* j, int cc, int32_t pc) {
+	size_t at = jit_jump(j, cc);
+	if (j->fixups_size + 2 > j->fixups_capacity) {
+		j->fixups_capacity = j->fixups_capacity * 2 + 16;
+		j->fixups = (size_t*)realloc(
+		    j->fixups, j->fixups_capacity * sizeof(size_t));
+	}
+
+	j->fixups[j->fixups_size++] = at;
+	j->fixups[j->fixups_size++] = (size_t)pc;
+}
+
+/* Leaves the op at pc to the interpreter, or fails with the state's error */
+void jit_exit(um_Jit* j, int32_t pc) {
+	jit_mem(j, 0, false, 0xc7, 0, R13, offsetof(um_JitState, pc));
+	jit_u32(j, (uint32_t)pc);
+	jit_reg(j, false, 0x31, RAX, RAX);
+	jit_patch(j, jit_jump(j, -1), j->epilogue);
+}
+
+void jit_fail(um_Jit* j) {
+	jit_byte(j, 0xb8);
+	jit_u32(j, 1);
+	jit_patch(j, jit_jump(j, -1), j->epilogue);
+}
+
+void jit_call_c(um_Jit* j, uintptr_t fn) {
+	jit_mov_imm(j, RAX, fn);
+	jit_reg(j, false, 0xff, 2, RAX);
+}
+
+/* Calls helper fn(state, x) for the op at pc */
+void jit_helper(um_Jit* j, um_JitHelper fn, int32_t x, int32_t pc) {
+	size_t ok, error;
+
+	jit_mem(j, 0, true, 0x89, RBX, R13, offsetof(um_JitState, sp));
+	jit_reg(j, true, 0x89, R13, RDI);
+	jit_byte(j, 0xbe);
+	jit_u32(j, (uint32_t)x);
+	jit_call_c(j, (uintptr_t)fn);
+	jit_mem(j, 0, true, 0x8b, RBX, R13, offsetof(um_JitState, sp));
+	jit_reg(j, false, 0x85, RAX, RAX);
+	ok = jit_jump(j, 0x4);
+	jit_byte(j, 0x83);
+	jit_byte(j, 0xf8);
+	jit_byte(j, JIT_EXIT);
+	error = jit_jump(j, 0x5);
+	jit_exit(j, pc);
+	jit_patch(j, error, j->size);
+	jit_fail(j);
+	jit_patch(j, ok, j->size);
+}
+
+/* Pushes the noun at [base + disp] */
+void jit_push(um_Jit* j, int base, int32_t disp) {
+	jit_mem(j, 0, true, 0x8b, RCX, base, disp);
+	jit_mem(j, 0, true, 0x8b, RDX, base, disp + 8);
+	jit_mem(j, 0, true, 0x89, RCX, RBX, 0);
+	jit_mem(j, 0, true, 0x89, RDX, RBX, 8);
+	jit_arith_imm(j, 0, RBX, sizeof(um_Noun));
+}
+
+/* The type and mut words of a noun made by new (...) */
+uint64_t jit_header(um_NounType t) {
+	um_Noun a;
+	uint64_t h;
+	memset(&a, 0, sizeof(a));
+	a.type = t;
+	a.mut = true;
+	memcpy(&h, &a, sizeof(h));
+	return h;
+}
+
+/* Replaces a callee and its two operands with a result of type t, whose value
+ * is already in place */
+void jit_result(um_Jit* j, um_NounType t) {
+	jit_mov_imm(j, RAX, jit_header(t));
+	jit_mem(j, 0, true, 0x89, RAX, RBX, -48);
+	jit_arith_imm(j, 5, RBX, 32);
+}
+
+/* setcc al, then the boolean as the result */
+void jit_result_bool(um_Jit* j, int cc) {
+	jit_byte(j, 0x0f);
+	jit_byte(j, 0x90 | cc);
+	jit_byte(j, 0xc0);
+	jit_reg(j, false, 0xfb6, RAX, RAX);
+	jit_mem(j, 0, true, 0x89, RAX, RBX, -40);
+	jit_result(j, bool_t);
+}
+
+/* A call of fn on two integers or two floats done inline, falling through to
+ * the generic call emitted next when the guards fail. Returns how many jumps
+ * past that call it left in done */
+size_t jit_arith(um_Jit* j, um_Builtin fn, size_t* done) {
+	size_t generic[8], reals[2], i, n = 0;
+	int cc = fn == builtin_less	 ? 0xc
+		 : fn == builtin_greater ? 0xf
+		 : fn == builtin_eq	 ? 0x4
+					 : -1;
+
+	jit_cmp_type(j, RBX, -48, builtin_t);
+	generic[n++] = jit_jump(j, 0x5);
+	jit_mov_imm(j, RAX, (uint64_t)(uintptr_t)fn);
+	jit_mem(j, 0, true, 0x3b, RAX, RBX, -40);
+	generic[n++] = jit_jump(j, 0x5);
+
+	/* Integers, that go the generic way when they overflow */
+	jit_cmp_type(j, RBX, -32, integer_t);
+	reals[0] = jit_jump(j, 0x5);
+	jit_cmp_type(j, RBX, -16, integer_t);
+	reals[1] = jit_jump(j, 0x5);
+	jit_mem(j, 0, true, 0x8b, RAX, RBX, -24);
+	if (cc >= 0) {
+		jit_mem(j, 0, true, 0x3b, RAX, RBX, -8);
+		jit_result_bool(j, cc);
+	} else {
+		jit_mem(j,
+			0,
+			true,
+			fn == builtin_add	 ? 0x03
+			: fn == builtin_subtract ? 0x2b
+						 : 0xfaf,
+			RAX,
+			RBX,
+			-8);
+		generic[n++] = jit_jump(j, 0x0);
+		jit_mem(j, 0, true, 0x89, RAX, RBX, -40);
+		jit_result(j, integer_t);
+	}
+
+	done[0] = jit_jump(j, -1);
+	if (fn == builtin_eq) {
+		generic[n++] = reals[0];
+		generic[n++] = reals[1];
+		for (i = 0; i < n; i++) { jit_patch(j, generic[i], j->size); }
+		return 1;
+	}
+
+	/* Floats, compared so that NaN is neither less nor greater */
+	for (i = 0; i < 2; i++) { jit_patch(j, reals[i], j->size); }
+	jit_cmp_type(j, RBX, -32, real_t);
+	generic[n++] = jit_jump(j, 0x5);
+	jit_cmp_type(j, RBX, -16, real_t);
+	generic[n++] = jit_jump(j, 0x5);
+	if (cc >= 0) {
+		jit_mem(j, 0xf2, false, 0xf10, 0, RBX, cc == 0xc ? -8 : -24);
+		jit_mem(j, 0x66, false, 0xf2e, 0, RBX, cc == 0xc ? -24 : -8);
+		jit_result_bool(j, 0x7);
+	} else {
+		jit_mem(j, 0xf2, false, 0xf10, 0, RBX, -24);
+		jit_mem(j,
+			0xf2,
+			false,
+			fn == builtin_add	 ? 0xf58
+			: fn == builtin_subtract ? 0xf5c
+						 : 0xf59,
+			0,
+			RBX,
+			-8);
+		jit_mem(j, 0xf2, false, 0xf11, 0, RBX, -40);
+		jit_result(j, real_t);
+	}
+
+	done[1] = jit_jump(j, -1);
+	for (i = 0; i < n; i++) { jit_patch(j, generic[i], j->size); }
+	return 2;
+}
+
+/* Which of the builtins done inline the callee pushed by the op at pc is
+ * bound to now, if any. It is only a guess, checked whenever the call runs */
+um_Builtin jit_guess(um_Code* code, int32_t pc) {
+	um_TableEntry* e = NULL;
+	um_Builtin fn;
+	int32_t x;
+
+	if (code->ops[pc] == OP_GLOBAL) {
+		x = code->ops[pc + 1];
+		e = table_get_sym(cdr(env).value.table,
+				  code->constants[x].value.symbol);
+	} else if (code->ops[pc] == OP_CELL) {
+		e = code->cells[code->ops[pc + 1]];
+	}
+
+	if (!e || e->v.type != builtin_t) { return NULL; }
+
+	fn = e->v.value.builtin;
+	return fn == builtin_add || fn == builtin_subtract
+		    || fn == builtin_multiply || fn == builtin_less
+		    || fn == builtin_greater || fn == builtin_eq
+		? fn
+		: NULL;
+}
+
+void jit_compile(um_Code* code) {
+	um_Jit j;
+	size_t n = code->size / 2, i, k, depth = 0, next, slow[2];
+	size_t done[2];
+	int32_t pc, op, x, *producer, *depth_at;
+	uint32_t* map;
+	bool reachable = true;
+	um_Table** globals;
+	um_Builtin fn;
+	void* mem;
+
+	/* The code below takes a noun to be its type then its value, 8 apart */
+	if (sizeof(um_Noun) != 16 || offsetof(um_Noun, value) != 8) { return; }
+
+	memset(&j, 0, sizeof(j));
+	map = (uint32_t*)malloc(n * sizeof(uint32_t));
+	producer = (int32_t*)calloc(code->max_stack + 1, sizeof(int32_t));
+	depth_at = (int32_t*)malloc(n * sizeof(int32_t));
+	for (i = 0; i < n; i++) { depth_at[i] = -1; }
+
+	/* Save rbx and r12 to r15, load the state and go to the op wanted */
+	jit_byte(&j, 0x53);
+	for (k = R12; k <= R15; k++) {
+		jit_byte(&j, 0x41);
+		jit_byte(&j, 0x50 | (k & 7));
+	}
+
+	jit_reg(&j, true, 0x89, RDI, R13);
+	jit_mem(&j, 0, true, 0x8b, RBX, R13, offsetof(um_JitState, sp));
+	jit_mem(&j, 0, true, 0x8b, R12, R13, offsetof(um_JitState, slots));
+	jit_mov_imm(&j, R14, (uintptr_t)code->constants);
+	jit_mov_imm(&j, R15, (uintptr_t)code->cells);
+	jit_mem(&j, 0, false, 0xff, 4, R13, offsetof(um_JitState, target));
+
+	j.epilogue = j.size;
+	jit_mem(&j, 0, true, 0x89, RBX, R13, offsetof(um_JitState, sp));
+	for (k = R15; k >= R12; k--) {
+		jit_byte(&j, 0x41);
+		jit_byte(&j, 0x58 | (k & 7));
+	}
+
+	jit_byte(&j, 0x5b);
+	jit_byte(&j, 0xc3);
+
+	for (i = 0; i < n; i++) {
+		pc = (int32_t)(i * 2);
+		op = code->ops[pc];
+		x = code->ops[pc + 1];
+		map[i] = (uint32_t)j.size;
+
+		/* Follow the stack depth to know which op pushed each callee */
+		if (!reachable && depth_at[i] >= 0) { depth = depth_at[i]; }
+		if (depth > code->max_stack) { depth = code->max_stack; }
+		reachable = true;
+
+		switch (op) {
+			case OP_CONST: jit_push(&j, R14, x * 16); break;
+			case OP_LOCAL:
+				jit_cmp_type(&j, R12, x * 16, unbound_t);
+				slow[0] = jit_jump(&j, 0x4);
+				jit_push(&j, R12, x * 16);
+				next = jit_jump(&j, -1);
+				jit_patch(&j, slow[0], j.size);
+				jit_helper(&j, jit_local, x, pc);
+				jit_patch(&j, next, j.size);
+				break;
+			case OP_ENV: jit_helper(&j, jit_env, x, pc); break;
+			case OP_CHECK: jit_helper(&j, jit_check, x, pc); break;
+			case OP_GLOBAL:
+				/* The cached binding, if still for this root */
+				globals = &code->globals.value.table;
+				jit_mov_imm(&j, RAX, (uintptr_t)globals);
+				jit_mem(&j, 0, true, 0x8b, RAX, RAX, 0);
+				jit_mem(&j,
+					0,
+					true,
+					0x3b,
+					RAX,
+					R13,
+					offsetof(um_JitState, root));
+				slow[0] = jit_jump(&j, 0x5);
+				jit_mem(&j, 0, true, 0x8b, RAX, R15, x * 8);
+				jit_reg(&j, true, 0x85, RAX, RAX);
+				slow[1] = jit_jump(&j, 0x4);
+				jit_push(&j, RAX, offsetof(um_TableEntry, v));
+				next = jit_jump(&j, -1);
+				jit_patch(&j, slow[0], j.size);
+				jit_patch(&j, slow[1], j.size);
+				jit_helper(&j, jit_global, x, pc);
+				jit_patch(&j, next, j.size);
+				break;
+			case OP_CELL:
+				jit_mem(&j, 0, true, 0x8b, RAX, R15, x * 8);
+				jit_push(&j, RAX, offsetof(um_TableEntry, v));
+				break;
+			case OP_POP: jit_arith_imm(&j, 5, RBX, 16); break;
+			case OP_PICK: jit_push(&j, RBX, -x * 16); break;
+			case OP_SWITCH:
+				jit_helper(&j, jit_switch, x, pc);
+				jit_mem(&j,
+					0,
+					true,
+					0x8b,
+					RAX,
+					R13,
+					offsetof(um_JitState, target));
+				jit_reg(&j, true, 0x85, RAX, RAX);
+				next = jit_jump(&j, 0x4);
+				jit_reg(&j, false, 0xff, 4, RAX);
+				jit_patch(&j, next, j.size);
+				break;
+			case OP_JUMP:
+				jit_jump_op(&j, -1, x);
+				if (depth_at[x / 2] < 0) {
+					depth_at[x / 2] = (int32_t)depth;
+				}
+
+				reachable = false;
+				break;
+			case OP_JUMP_FALSE:
+				/* Booleans and nil inline, others by a call */
+				jit_arith_imm(&j, 5, RBX, 16);
+				jit_cmp_type(&j, RBX, 0, bool_t);
+				slow[0] = jit_jump(&j, 0x5);
+				jit_mem(&j, 0, false, 0x80, 7, RBX, 8);
+				jit_byte(&j, 0);
+				jit_jump_op(&j, 0x4, x);
+				next = jit_jump(&j, -1);
+				jit_patch(&j, slow[0], j.size);
+				jit_cmp_type(&j, RBX, 0, nil_t);
+				jit_jump_op(&j, 0x4, x);
+				jit_cmp_type(&j, RBX, 0, noreturn_t);
+				jit_jump_op(&j, 0x4, x);
+				jit_reg(&j, true, 0x89, RBX, RDI);
+				jit_call_c(&j, (uintptr_t)jit_truthy);
+				jit_reg(&j, false, 0x85, RAX, RAX);
+				jit_jump_op(&j, 0x4, x);
+				jit_patch(&j, next, j.size);
+				if (depth) { depth--; }
+				if (depth_at[x / 2] < 0) {
+					depth_at[x / 2] = (int32_t)depth;
 				}
-			} else if (op.value.symbol == sym_quote.value.symbol) {
-				if (isnil(args) || !isnil(cdr(args))) {
-					stack_restore(ss);
-					return MakeErrorCode(ERROR_ARGS);
+
+				break;
+			case OP_CALL:
+			case OP_TAIL_CALL:
+				fn = x == 2 && depth >= 3
+				       ? jit_guess(code, producer[depth - 3])
+				       : NULL;
+				k = fn ? jit_arith(&j, fn, done) : 0;
+				jit_helper(&j, jit_call, x, pc);
+				while (k) { jit_patch(&j, done[--k], j.size); }
+
+				depth = depth > (size_t)x ? depth - x : 1;
+				producer[depth - 1] = pc;
+				continue;
+			case OP_CLOSURE:
+				jit_helper(&j, jit_closure, x, pc);
+				break;
+			case OP_STORE_LOCAL:
+				jit_helper(&j, jit_store_local, x, pc);
+				break;
+			case OP_STORE_ENV:
+				jit_helper(&j, jit_store_env, x, pc);
+				break;
+			case OP_STORE_GLOBAL:
+				jit_helper(&j, jit_store_global, x, pc);
+				break;
+			case OP_RETURN:
+				jit_exit(&j, pc);
+				reachable = false;
+				break;
+			default: jit_exit(&j, pc); break;
+		}
+
+		switch (op) {
+			case OP_CONST:
+			case OP_LOCAL:
+			case OP_ENV:
+			case OP_GLOBAL:
+			case OP_CELL:
+			case OP_CHECK:
+			case OP_PICK:
+			case OP_CLOSURE:
+			case OP_FAIL:
+				if (depth < code->max_stack) {
+					producer[depth++] = pc;
 				}
 
-				*result = car(args);
-				stack_restore_add(ss, *result);
-				return MakeErrorCode(OK);
-			} else if (op.value.symbol == sym_fn.value.symbol
-				   || op.value.symbol
-					  == intern("\\").value.symbol) {
-				if (isnil(args) || isnil(cdr(args))) {
-					stack_restore(ss);
-					return MakeErrorCode(ERROR_ARGS);
-				}
+				break;
+			case OP_POP:
+			case OP_RETURN:
+				if (depth) { depth--; }
+				break;
+			default: break;
+		}
+	}
+
+	for (i = 0; i < j.fixups_size; i += 2) {
+		jit_patch(&j, j.fixups[i], map[j.fixups[i + 1] / 2]);
+	}
+
+	mem = mmap(NULL,
+		   j.size,
+		   PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS,
+		   -1,
+		   0);
+	if (mem != MAP_FAILED) {
+		memcpy(mem, j.data, j.size);
+		if (!mprotect(mem, j.size, PROT_READ | PROT_EXEC)) {
+			code->jit = (unsigned char*)mem;
+			code->jit_size = j.size;
+			code->jit_map = map;
+			map = NULL;
+		} else {
+			munmap(mem, j.size);
+		}
+	}
+
+	free(map);
+	free(producer);
+	free(depth_at);
+	free(j.data);
+	free(j.fixups);
+}
+
+/* Runs the frame f in its machine code from pc, returning 1 when it failed */
+int jit_run(
+    um_Frame* f, int32_t** pc, um_Noun** sp, size_t mark, um_Error* err) {
+	um_Code* code = f->code.value.code;
+	um_JitState s;
+	um_Noun e = f->env;
+	int (*native)(um_JitState*);
+	int r;
+
+	while (e.type == vector_t) { e = e.value.vector_v->data[0]; }
+
+	s.sp = *sp;
+	s.slots = f->slots;
+	s.target = code->jit + code->jit_map[(*pc - code->ops) / 2];
+	s.root = cdr(e).value.table;
+	s.frame = f - vm_frames;
+	s.mark = mark;
+	memcpy(&native, &code->jit, sizeof(native));
+	r = native(&s);
+	*sp = s.sp;
+	*pc = code->ops + s.pc;
+	*err = s.err;
+	return r;
+}
+#endif
+
+/* Dispatch through computed goto is a GNU extension, which -pedantic would
+ * warn about at every op */
+#ifdef __GNUC__
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+
+/* Runs frames until the one at entry returns. Calls between closures stay
+ * inside this loop, only builtins calling back into Um nest another run */
+um_Error vm_run(size_t entry, um_Noun* result) {
+	size_t mark = stack_size, base = vm_frames[entry].base;
+	um_Frame* f = &vm_frames[vm_frames_size - 1];
+	um_Code* code = f->code.value.code;
+	int32_t* pc = code->ops;
+	um_Noun* sp = vm_stack + vm_sp;
+	um_Noun fn, r, e;
+	um_Vector v;
+	um_Error err;
+	int32_t x;
+
+#ifdef __GNUC__
+	static void* dispatch[] = {&&op_const,
+				   &&op_local,
+				   &&op_env,
+				   &&op_global,
+				   &&op_cell,
+				   &&op_check,
+				   &&op_pop,
+				   &&op_pick,
+				   &&op_switch,
+				   &&op_jump,
+				   &&op_jump_false,
+				   &&op_call,
+				   &&op_tail_call,
+				   &&op_return,
+				   &&op_closure,
+				   &&op_store_local,
+				   &&op_store_env,
+				   &&op_store_global,
+				   &&op_fail};
+#define VM_CASE(name, label) \
+	case name:           \
+	label:
+#define VM_NEXT() goto* dispatch[pc[0]]
+#else
+#define VM_CASE(name, label) case name:
+#define VM_NEXT() continue
+#endif
+
+	/* A frame entered or returned to goes on in its machine code if any */
+#ifdef UM_JIT
+#define VM_RESUME()                        \
+	if (code->jit) { goto jit_entry; } \
+	VM_NEXT()
 
-				err = new_closure(
-				    env, car(args), cdr(args), result);
-				stack_restore_add(ss, *result);
-				return err;
-			} else if (op.value.symbol == sym_do.value.symbol) {
+	if (code->jit) { goto jit_entry; }
+#else
+#define VM_RESUME() VM_NEXT()
+#endif
 
-				*result = nil;
-				while (!isnil(args)) {
-					if (isnil(cdr(args))) {
+	for (;;) {
+		switch (pc[0]) {
+			VM_CASE(OP_CONST, op_const)
+			x = pc[1];
+			pc += 2;
+			*sp++ = code->constants[x];
+			VM_NEXT();
+
+			VM_CASE(OP_LOCAL, op_local)
+			x = pc[1];
+			pc += 2;
+			*sp = f->slots[x];
+			if (sp->type == unbound_t) {
+				err = vm_lookup(
+				    vm_outer(f), code->locals[x], sp);
+				if (err._) { goto fail; }
+			}
 
-						expr = car(args);
-						stack_restore(ss);
-						goto start;
+			sp++;
+			VM_NEXT();
+
+			VM_CASE(OP_ENV, op_env)
+			x = pc[1];
+			pc += 2;
+			err = vm_env(f, x, sp);
+			if (err._) { goto fail; }
+
+			sp++;
+			VM_NEXT();
+
+			VM_CASE(OP_GLOBAL, op_global)
+			x = pc[1];
+			pc += 2;
+			err = vm_global(f->code, x, f->env, sp);
+			if (err._) { goto fail; }
+
+			sp++;
+			VM_NEXT();
+
+			VM_CASE(OP_CELL, op_cell)
+			x = pc[1];
+			pc += 2;
+			*sp++ = code->cells[x]->v;
+			VM_NEXT();
+
+			VM_CASE(OP_CHECK, op_check)
+			x = pc[1];
+			pc += 2;
+			*sp++ = new_bool(vm_check(f, x));
+			VM_NEXT();
+
+			VM_CASE(OP_POP, op_pop)
+			pc += 2;
+			sp--;
+			VM_NEXT();
+
+			VM_CASE(OP_PICK, op_pick)
+			x = pc[1];
+			pc += 2;
+			*sp = sp[-x];
+			sp++;
+			VM_NEXT();
+
+			VM_CASE(OP_SWITCH, op_switch)
+			x = pc[1];
+			pc += 2;
+			x = vm_switch(code->constants[x], sp[-1]);
+			if (x >= 0) { pc = code->ops + x; }
+			VM_NEXT();
+
+			VM_CASE(OP_JUMP, op_jump)
+			x = pc[1];
+#ifdef UM_JIT
+			/* Going round a loop counts as a call, so a hot loop
+			 * goes on in machine code */
+			if (code->ops + x < pc && !code->jit
+			    && ++code->calls == UM_JIT_THRESHOLD) {
+				jit_compile(code);
+			}
+#endif
+			pc = code->ops + x;
+			VM_RESUME();
+
+			VM_CASE(OP_JUMP_FALSE, op_jump_false)
+			x = pc[1];
+			pc += 2;
+			if (!um_truthy(*--sp)) { pc = code->ops + x; }
+			VM_NEXT();
+
+			VM_CASE(OP_CALL, op_call)
+			VM_CASE(OP_TAIL_CALL, op_tail_call)
+			x = pc[1];
+			fn = sp[-x - 1];
+
+			/* apply spreads its list over the stack and calls in
+			 * place, so a call through it can be a tail call */
+			while (fn.type == builtin_t
+			       && fn.value.builtin == builtin_apply && x == 2
+			       && listp(sp[-1])) {
+				e = sp[-1];
+				fn = sp[-2];
+				sp -= 3;
+				*sp++ = fn;
+				for (x = 0; !isnil(e); e = cdr(e), x++) {
+					if (sp == vm_stack + vm_stack_limit) {
+						err = MakeErrorCode(ERROR_STACK);
+						goto fail;
 					}
 
-					err = eval_expr(car(args), env, result);
-					if (err._) { return err; }
-
-					args = cdr(args);
+					*sp++ = car(e);
 				}
+			}
 
-				return MakeErrorCode(OK);
-			} else if (op.value.symbol == sym_mac.value.symbol) {
+			if (x == 2 && fn.type == builtin_t
+			    && vm_arith(fn.value.builtin, sp[-2], sp[-1], &r)) {
+				pc += 2;
+				sp -= 3;
+				*sp++ = r;
+				VM_NEXT();
+			}
 
-				if (isnil(args) || isnil(cdr(args))
-				    || isnil(cdr(cdr(args)))) {
-					stack_restore(ss);
-					return MakeErrorCode(ERROR_ARGS);
+			vm_sp = sp - vm_stack;
+
+			if (fn.type == closure_t) {
+				if (pc[0] == OP_TAIL_CALL) {
+					/* The callee and its arguments replace
+					 * the returning frame */
+					memmove(vm_stack + f->base - 1,
+						sp - x - 1,
+						(x + 1) * sizeof(um_Noun));
+					vm_sp = f->base + x;
+					vm_frames_size--;
+				} else {
+					f->pc = pc + 2 - code->ops;
 				}
 
-				name = car(args);
-				if (name.type != noun_t) {
-					stack_restore(ss);
-					return MakeErrorCode(ERROR_TYPE);
-				}
+				err = vm_enter(fn, x);
+				if (err._) { goto fail; }
 
-				err = new_closure(env,
-						  car(cdr(args)),
-						  cdr(cdr(args)),
-						  &macro);
-				if (!err._) {
-					macro.type = macro_t;
-					*result = name;
-					err = env_assign(
-					    env, name.value.symbol, macro);
-					stack_restore_add(ss, *result);
-					return err;
-				} else {
-					stack_restore(ss);
-					return err;
-				}
+				f = &vm_frames[vm_frames_size - 1];
+				code = f->code.value.code;
+				pc = code->ops;
+				sp = vm_stack + vm_sp;
+				vm_safe_point(mark);
+				VM_RESUME();
 			}
-		}
 
-		err = eval_expr(op, env, &fn);
-		if (err._) {
-			stack_restore(ss);
-			return err;
-		}
+			v.data = sp - x;
+			v.size = v.capacity = x;
+			if (fn.type == builtin_t) {
+				err = fn.value.builtin
+					? fn.value.builtin(&v, &r)
+					: MakeErrorCode(ERROR_TYPE);
+			} else {
+				err = apply(fn, &v, &r);
+			}
 
-		vector_new(&v_params);
-		p = args;
-		while (!isnil(p)) {
-			err = eval_expr(car(p), env, &r);
-			if (err._) {
-				vector_free(&v_params);
-				stack_restore(ss);
-				return err;
+			if (err._) { goto fail; }
+
+			/* The builtin may have run Um code and moved the frames */
+			f = &vm_frames[vm_frames_size - 1];
+			pc += 2;
+			sp -= x + 1;
+			*sp++ = r;
+			vm_sp = sp - vm_stack;
+			vm_safe_point(mark);
+			VM_NEXT();
+
+			VM_CASE(OP_RETURN, op_return)
+			r = sp[-1];
+			sp = vm_stack + f->base - 1;
+			vm_frames_size--;
+			if (vm_frames_size == entry) {
+				vm_sp = sp - vm_stack;
+				stack_size = mark;
+				stack_add(r);
+				*result = r;
+				return MakeErrorCode(OK);
 			}
 
-			vector_add(&v_params, r);
-			p = cdr(p);
+			*sp++ = r;
+			f = &vm_frames[vm_frames_size - 1];
+			code = f->code.value.code;
+			pc = code->ops + f->pc;
+			VM_RESUME();
+
+			VM_CASE(OP_CLOSURE, op_closure)
+			x = pc[1];
+			pc += 2;
+			*sp++ = new_closure(f->env, code->constants[x]);
+			VM_NEXT();
+
+			VM_CASE(OP_STORE_LOCAL, op_store_local)
+			x = pc[1];
+			pc += 2;
+			vm_bind_value(x >> 24, &sp[-1]);
+			err = vm_store_local(f, x, sp[-1]);
+			if (err._) { goto fail; }
+			VM_NEXT();
+
+			VM_CASE(OP_STORE_ENV, op_store_env)
+			x = pc[1];
+			pc += 2;
+			vm_bind_value(x >> 24, &sp[-1]);
+			err = vm_store_env(f, x, sp[-1]);
+			if (err._) { goto fail; }
+			VM_NEXT();
+
+			VM_CASE(OP_STORE_GLOBAL, op_store_global)
+			x = pc[1];
+			pc += 2;
+			vm_bind_value(x >> 24, &sp[-1]);
+			err = vm_assign(f->env,
+					code->constants[x & 0xffffff],
+					x >> 24,
+					sp[-1]);
+			if (err._) { goto fail; }
+			VM_NEXT();
+
+			VM_CASE(OP_FAIL, op_fail)
+			err = MakeErrorCode((um_ErrorCode)pc[1]);
+			goto fail;
 		}
 
-		if (fn.type == closure_t) {
-			arg_names = car(cdr(fn));
-			env = env_create(car(fn), list_len(arg_names));
-			expr = car(cdr(cdr(fn)));
+#ifdef UM_JIT
+	jit_entry:
+		if (jit_run(f, &pc, &sp, mark, &err)) { goto fail; }
 
-			err = env_bind(env, arg_names, &v_params);
-			if (err._) { return err; }
+		f = &vm_frames[vm_frames_size - 1];
+		VM_NEXT();
+#endif
+	}
 
-			vector_free(&v_params);
-			goto start;
-		} else {
-			err = apply(fn, &v_params, result);
-			vector_free(&v_params);
-		}
+#undef VM_CASE
+#undef VM_NEXT
+#undef VM_RESUME
 
-		stack_restore_add(ss, *result);
+fail:
+	vm_sp = base - 1;
+	vm_frames_size = entry;
+	stack_size = mark;
+	return err;
+}
+#ifdef __GNUC__
+#pragma GCC diagnostic pop
+#endif
+
+/* Calls closure fn from outside the VM */
+um_Error vm_apply(um_Noun fn, um_Vector* v_params, um_Noun* result) {
+	size_t entry = vm_frames_size, sp = vm_sp, i;
+	um_Error err;
+
+	if (vm_sp + v_params->size + 1 > vm_stack_limit) {
+		return MakeErrorCode(ERROR_STACK);
+	}
+
+	vm_stack[vm_sp++] = fn;
+	for (i = 0; i < v_params->size; i++) {
+		vm_stack[vm_sp++] = v_params->data[i];
+	}
+
+	if (um_nest == UM_NEST_MAX) {
+		vm_sp = sp;
+		return MakeErrorCode(ERROR_STACK);
+	}
+
+	err = vm_enter(fn, v_params->size);
+	if (err._) {
+		vm_sp = sp;
 		return err;
 	}
+
+	um_nest++;
+	err = vm_run(entry, result);
+	um_nest--;
+	return err;
+}
+
+um_Error vm_execute(um_Noun code, um_Noun env, um_Noun* result) {
+	size_t entry = vm_frames_size;
+	um_Frame* f;
+	um_Error err;
+
+	if (vm_sp + 1 + code.value.code->max_stack > vm_stack_limit
+	    || um_nest == UM_NEST_MAX) {
+		return MakeErrorCode(ERROR_STACK);
+	}
+
+	/* Top level code has no slots, only a place for its result */
+	vm_stack[vm_sp++] = code;
+	f = vm_push_frame();
+	f->code = code;
+	f->env = env;
+	f->slots = NULL;
+	f->pc = 0;
+	f->base = vm_sp;
+	um_nest++;
+	err = vm_run(entry, result);
+	um_nest--;
+	return err;
+}
+
+um_Error eval_expr(um_Noun expr, um_Noun env, um_Noun* result) {
+	return vm_execute(compile(expr), env, result);
 }
 
 um_Error env_get(um_Noun env, char* symbol, um_Noun* result) {
@@ -1648,361 +4580,750 @@ um_Error env_assign(um_Noun env, char* symbol, um_Noun value) {
 	return table_set_sym(ptbl, symbol, value);
 }
 
-um_Error destructuring_bind(um_Noun arg_name, um_Noun val, um_Noun env) {
-	um_Error err;
-	if (isnil(arg_name)) {
-		if (isnil(val)) {
-			return MakeErrorCode(OK);
+um_Noun env_create(um_Noun parent, size_t capacity) {
+	return cons(parent, new_table(capacity));
+}
+
+/* Settle the fate of everything allocated since the last minor collection:
+ * marked objects are promoted, the rest are freed */
+void garbage_collector_sweep_nursery() {
+	um_Page* page;
+	size_t i, slot;
+	void* a;
+
+	for (i = 0; i < nursery_size; i++) {
+		a = nursery[i].value.pair;
+		page = heap_page_of(a);
+		slot = heap_slot(page, a);
+		if (bit_get(page->mark, slot)) {
+			bit_clear(page->mark, slot);
+			bit_set(page->old, slot);
 		} else {
-			return MakeErrorCode(ERROR_ARGS);
+			heap_free(a);
+			alloc_count--;
 		}
-	} else if (arg_name.type == noun_t) {
-		return env_assign(env, arg_name.value.symbol, val);
-	} else if (arg_name.type == pair_t) {
-		if (val.type != pair_t) { return MakeErrorCode(ERROR_ARGS); }
+	}
 
-		err = destructuring_bind(car(arg_name), car(val), env);
-		if (err._) { return err; }
+	nursery_size = 0;
+}
 
-		return destructuring_bind(cdr(arg_name), cdr(val), env);
-	} else {
-		return MakeErrorCode(ERROR_ARGS);
+void garbage_collector_shade_roots() {
+	size_t i;
+	garbage_collector_shade(env);
+	for (i = 0; i < stack_size; i++) { garbage_collector_shade(stack[i]); }
+	for (i = 0; i < vm_sp; i++) { garbage_collector_shade(vm_stack[i]); }
+	for (i = 0; i < vm_frames_size; i++) {
+		garbage_collector_shade(vm_frames[i].code);
+		garbage_collector_shade(vm_frames[i].env);
+	}
+
+	for (i = 0; macex_cache && i < UM_MACEX_CACHE; i++) {
+		if (macex_cache[i].epoch == macex_epoch) {
+			garbage_collector_shade(macex_cache[i].form);
+			garbage_collector_shade(macex_cache[i].expansion);
+		}
 	}
 }
 
-um_Error env_bind(um_Noun env, um_Noun arg_names, um_Vector* v_params) {
-	um_Noun arg_name, val;
-	int val_unspecified = 0;
-	um_Error err;
-	size_t i = 0;
+/* Everything marked is now old and everything else is garbage, which is left
+ * for the allocator to sweep up page by page */
+void garbage_collector_finish() {
+	um_Heap* h;
+	um_Page* page;
+	size_t k, i;
 
-	while (!isnil(arg_names)) {
-		if (arg_names.type == noun_t) {
-			env_assign(env,
-				   arg_names.value.symbol,
-				   vector_to_noun(v_params, i));
-			i = v_params->size;
-			break;
+	alloc_count_old = 0;
+	for (k = 0; k < HEAP_KINDS; k++) {
+		h = &heaps[k];
+		for (page = h->pages; page; page = page->next) {
+			for (i = 0; i < page->words; i++) {
+				page->old[i] = page->mark[i] & page->used[i];
+				alloc_count_old += __builtin_popcountll(page->old[i]);
+				page->mark[i] = 0;
+				page->remembered[i] = 0;
+			}
+
+			page->limit = page->bump;
+			page->swept = false;
 		}
 
-		arg_name = car(arg_names);
+		h->free = NULL;
+		h->sweep = h->pages ? &h->pages : NULL;
+	}
+
+	nursery_size = 0;
+	remembered_size = 0;
+	alloc_count = alloc_count_old;
+}
 
-		if (i < v_params->size) {
-			val = v_params->data[i];
-		} else {
-			val = nil;
-			val_unspecified = 1;
-		}
+void garbage_collector_run() {
+	gc_minor = false;
+	garbage_collector_shade_roots();
+	garbage_collector_drain();
+	garbage_collector_finish();
+}
 
-		err = destructuring_bind(arg_name, val, env);
-		if (err._) { return err; }
+/* Only young objects are traced, old ones count as marked and are reached
+ * through the remembered set instead; survivors are promoted so no old to
+ * young references remain afterwards */
+void garbage_collector_minor() {
+	size_t i;
+	um_Noun r;
+	um_Page* page;
 
-		arg_names = cdr(arg_names);
-		i++;
-	}
+	gc_minor = true;
+	garbage_collector_shade_roots();
 
-	if (i < v_params->size) { return MakeErrorCode(ERROR_ARGS); }
+	for (i = 0; i < remembered_size; i++) {
+		r = remembered[i];
+		page = heap_page_of(r.value.pair);
+		bit_clear(page->remembered, heap_slot(page, r.value.pair));
+		garbage_collector_blacken(r);
+	}
 
-	return MakeErrorCode(OK);
+	garbage_collector_drain();
+	remembered_size = 0;
+	garbage_collector_sweep_nursery();
+	gc_minor = false;
 }
 
-um_Noun env_create(um_Noun parent, size_t capacity) {
-	return cons(parent, new_table(capacity));
+/* Marks a and pushes it on the grey stack to have its children scanned. If the
+ * stack can't grow the object is left marked but unscanned and the overflow
+ * flag tells garbage_collector_drain to rescan the heap for such objects */
+void garbage_collector_shade(um_Noun a) {
+	um_Page* page;
+	size_t slot;
+	um_Noun* grey;
+
+	switch (a.type) {
+		case pair_t:
+		case closure_t:
+		case macro_t:
+		case string_t:
+		case table_t:
+		case code_t:
+		case vector_t: break;
+		default: return;
+	}
+
+	page = heap_page_of(a.value.pair);
+	slot = heap_slot(page, a.value.pair);
+	if (bit_get(page->mark, slot)
+	    || (gc_minor && bit_get(page->old, slot))) {
+		return;
+	}
+
+	bit_set(page->mark, slot);
+	if (a.type == string_t) { return; }
+
+	if (gc_grey_size == gc_grey_capacity) {
+		grey = gc_grey_capacity < UM_GC_GREY_MAX
+			 ? (um_Noun*)realloc(gc_grey,
+					     gc_grey_capacity * 2 * sizeof(um_Noun)
+						 + 256 * sizeof(um_Noun))
+			 : NULL;
+		if (!grey) {
+			gc_grey_overflow = true;
+			return;
+		}
+
+		gc_grey = grey;
+		gc_grey_capacity = gc_grey_capacity * 2 + 256;
+	}
+
+	gc_grey[gc_grey_size++] = a;
 }
 
-void garbage_collector_run() {
-	um_Pair *a, **p;
-	struct um_String *as, **ps;
-	um_Table *at, **pt;
+void garbage_collector_blacken(um_Noun a) {
 	size_t i;
+	um_TableEntry* e;
+	switch (a.type) {
+		case pair_t:
+		case closure_t:
+		case macro_t:
+			garbage_collector_shade(car(a));
+			garbage_collector_shade(cdr(a));
+			break;
+		case table_t:
+			for (i = 0; i < a.value.table->capacity; i++) {
+				for (e = a.value.table->data[i]; e; e = e->next) {
+					garbage_collector_shade(e->k);
+					garbage_collector_shade(e->v);
+				}
+			}
 
-	for (i = 0; i < stack_size; i++) { garbage_collector_tag(stack[i]); }
+			break;
+		case code_t:
+			for (i = 0; i < a.value.code->constants_size; i++) {
+				garbage_collector_shade(a.value.code->constants[i]);
+			}
 
-	alloc_count_old = 0;
+			garbage_collector_shade(a.value.code->args);
+			garbage_collector_shade(a.value.code->body);
+			garbage_collector_shade(a.value.code->globals);
+			break;
+		case vector_t:
+			for (i = 0; i < a.value.vector_v->size; i++) {
+				garbage_collector_shade(
+				    a.value.vector_v->data[i]);
+			}
 
-	p = &pair_head;
-	while (*p != NULL) {
-		a = *p;
-		if (!a->mark) {
-			*p = a->next;
-			free(a);
-		} else {
-			p = &a->next;
-			a->mark = 0;
-			alloc_count_old++;
-		}
+			break;
+		default: break;
 	}
+}
 
-	ps = &str_head;
-	while (*ps != NULL) {
-		as = *ps;
-		if (!as->mark) {
-			*ps = as->next;
-			free(as->value);
-			free(as);
-		} else {
-			ps = &as->next;
-			as->mark = 0;
-			alloc_count_old++;
+/* Blacken every marked object that may have missed its scan, either young
+ * ones after a minor collection or anything in the heap after a full one */
+void garbage_collector_rescan() {
+	um_Page* page;
+	um_Noun a;
+	size_t k, i;
+	static const um_NounType heap_types[HEAP_KINDS]
+	    = {pair_t, string_t, table_t, code_t, vector_t};
+
+	gc_grey_overflow = false;
+
+	if (gc_minor) {
+		for (i = 0; i < nursery_size; i++) {
+			a = nursery[i];
+			page = heap_page_of(a.value.pair);
+			if (bit_get(page->mark, heap_slot(page, a.value.pair))) {
+				garbage_collector_blacken(a);
+			}
 		}
+
+		return;
 	}
 
-	pt = &table_head;
-	while (*pt != NULL) {
-		at = *pt;
-		if (!at->mark) {
-			*pt = at->next;
-			for (i = 0; i < at->capacity; i++) {
-				um_TableEntry* e = at->data[i];
-				while (e) {
-					um_TableEntry* next = e->next;
-					free(e);
-					e = next;
-					/* If you're reading this,
-					 * please go to sleep;
-					 * it's late */
+	for (k = HEAP_PAIR; k < HEAP_KINDS; k++) {
+		if (k == HEAP_STRING) { continue; }
+
+		a.type = heap_types[k];
+		for (page = heaps[k].pages; page; page = page->next) {
+			for (i = 0; i < page->bump; i++) {
+				if (bit_get(page->mark, i) && bit_get(page->used, i)) {
+					a.value.pair = (um_Pair*)(page->data
+								  + i * heaps[k].size);
+					garbage_collector_blacken(a);
 				}
 			}
+		}
+	}
+}
 
-			free(at->data);
-			free(at);
-		} else {
-			pt = &at->next;
-			at->mark = 0;
-			alloc_count_old++;
+void garbage_collector_drain() {
+	for (;;) {
+		while (gc_grey_size) {
+			garbage_collector_blacken(gc_grey[--gc_grey_size]);
 		}
+
+		if (!gc_grey_overflow) { return; }
+
+		garbage_collector_rescan();
 	}
+}
 
-	alloc_count = alloc_count_old;
+void garbage_collector_start() {
+	gc_phase = GC_MARK;
+	garbage_collector_shade_roots();
+}
+
+/* Blacken grey objects until the stack runs dry or the budget is spent,
+ * checking the clock every few hundred objects. The stacks are roots the write
+ * barrier does not see, so once nothing is grey they are shaded again, and
+ * whatever that turns grey is blackened in this step or the next ones. Only
+ * when shading them finds nothing new is the cycle finished off */
+void garbage_collector_step() {
+	clock_t deadline
+	    = clock() + (clock_t)(gc_pause_budget * CLOCKS_PER_SEC / 1000);
+	size_t n = 0;
+
+	for (;;) {
+		while (gc_grey_size) {
+			garbage_collector_blacken(gc_grey[--gc_grey_size]);
+			if (++n % 256 == 0 && clock() >= deadline) { return; }
+		}
+
+		if (gc_grey_overflow) {
+			garbage_collector_rescan();
+			continue;
+		}
+
+		garbage_collector_shade_roots();
+		if (!gc_grey_size && !gc_grey_overflow) { break; }
+	}
+
+	gc_phase = GC_IDLE;
+	garbage_collector_finish();
 }
 
 void garbage_collector_consider() {
-	if (alloc_count > 2 * alloc_count_old) { garbage_collector_run(); }
+	if (gc_phase == GC_MARK) {
+		garbage_collector_step();
+	} else if (alloc_count - nursery_size > 2 * alloc_count_old) {
+		if (gc_pause_budget > 0) {
+			garbage_collector_start();
+			garbage_collector_step();
+		} else {
+			garbage_collector_run();
+		}
+	} else if (nursery_size > UM_GC_NURSERY) {
+		garbage_collector_minor();
+	}
 }
 
-void garbage_collector_tag(um_Noun root) {
-	um_Pair* a;
-	struct um_String* as;
-	um_Table* at;
-	size_t i;
-	um_TableEntry* e;
-start:
-	switch (root.type) {
+/* Maximum time in milliseconds a single collection step may take, zero (the
+ * default) collects the whole heap in one go. Tracing keeps to the budget, but
+ * the steps that shade the roots and the one that ends the cycle also take
+ * time in proportion to the stacks and to the size of the heap, which is not
+ * budgeted */
+void um_gc_set_pause_budget(double ms) {
+	gc_pause_budget = ms;
+}
+
+/* Most values the VM stack may hold, which bounds how deep Um code recurses.
+ * It can be changed before um_init or between evaluations */
+void um_vm_set_stack_limit(size_t values) {
+	if (vm_frames_size) { return; }
+
+	vm_stack_limit = values;
+	if (vm_stack) {
+		free(vm_stack);
+		vm_stack = (um_Noun*)calloc(vm_stack_limit, sizeof(um_Noun));
+	}
+}
+
+void garbage_collector_log(um_Noun** log,
+			   size_t* size,
+			   size_t* capacity,
+			   um_Noun a) {
+	if (*size == *capacity) {
+		*capacity = *capacity ? *capacity * 2 : 256;
+		*log = (um_Noun*)realloc(*log, *capacity * sizeof(um_Noun));
+	}
+
+	(*log)[(*size)++] = a;
+}
+
+void garbage_collector_young(um_Noun a) {
+	garbage_collector_log(&nursery, &nursery_size, &nursery_capacity, a);
+}
+
+bool garbage_collector_is_young(um_Noun a) {
+	um_Page* page;
+
+	switch (a.type) {
 		case pair_t:
 		case closure_t:
 		case macro_t:
-			a = root.value.pair;
-			if (a->mark) return;
-			a->mark = 1;
-			garbage_collector_tag(car(root));
-
-			root = cdr(root);
-			goto start;
-			break;
 		case string_t:
-			as = root.value.string;
-			if (as->mark) return;
-			as->mark = 1;
-			break;
-		case table_t: {
-			at = root.value.table;
-			if (at->mark) return;
-			at->mark = 1;
-			for (i = 0; i < at->capacity; i++) {
-				e = at->data[i];
-				while (e) {
-					garbage_collector_tag(e->k);
-					garbage_collector_tag(e->v);
-					e = e->next;
-				}
+		case table_t:
+		case code_t:
+		case vector_t:
+			page = heap_page_of(a.value.pair);
+			return !bit_get(page->old, heap_slot(page, a.value.pair));
+		default: return false;
+	}
+}
+
+/* Must be called before an existing pair, table or vector has its reference
+ * to old replaced with one to value */
+void garbage_collector_barrier(um_Noun owner, um_Noun old_value, um_Noun value) {
+	um_Page* page;
+	size_t slot;
+
+	if (gc_phase == GC_MARK) { garbage_collector_shade(old_value); }
+	if (!garbage_collector_is_young(value)) { return; }
+
+	switch (owner.type) {
+		case pair_t:
+		case closure_t:
+		case macro_t:
+		case table_t:
+		case code_t:
+		case vector_t: break;
+		default: return;
+	}
+
+	page = heap_page_of(owner.value.pair);
+	slot = heap_slot(page, owner.value.pair);
+	if (!bit_get(page->old, slot) || bit_get(page->remembered, slot)) {
+		return;
+	}
+
+	bit_set(page->remembered, slot);
+	garbage_collector_log(
+	    &remembered, &remembered_size, &remembered_capacity, owner);
+}
+
+/* Tells whether a is a form like (sym x) */
+bool quasiquote_form(um_Noun a, um_Noun sym) {
+	return a.type == pair_t && car(a).type == noun_t
+	       && car(a).value.symbol == sym.value.symbol;
+}
+
+um_Error quasiquote_operand(um_Noun a, um_Noun* result) {
+	if (cdr(a).type != pair_t || !isnil(cdr(cdr(a)))) {
+		return MakeErrorCode(ERROR_ARGS);
+	}
+
+	*result = car(cdr(a));
+	return MakeErrorCode(OK);
+}
+
+um_Noun quasiquote_quote(um_Noun a, bool constant) {
+	return constant ? cons(sym_quote, cons(a, nil)) : a;
+}
+
+/* Turns a quasiquote template into code which builds it. Parts without
+ * unquotes are left for the caller to quote, so the built list shares
+ * them, and splices are appended in one call */
+um_Error quasiquote_expand(um_Noun x, um_Noun* result, bool* constant) {
+	um_Error err = MakeErrorCode(OK);
+	um_Noun h, a, tail;
+	um_Vector cells;
+	bool c;
+
+	*constant = true;
+	*result = x;
+	if (x.type != pair_t) { return err; }
+
+	if (quasiquote_form(x, sym_unquote)) {
+		*constant = false;
+		return quasiquote_operand(x, result);
+	}
+
+	vector_new(&cells);
+	for (h = x; h.type == pair_t && !quasiquote_form(h, sym_unquote);
+	     h = cdr(h)) {
+		vector_add(&cells, h);
+	}
+
+	err = quasiquote_expand(h, &tail, constant);
+	while (!err._ && cells.size) {
+		h = cells.data[--cells.size];
+		if (quasiquote_form(car(h), sym_unquote_splicing)) {
+			err = quasiquote_operand(car(h), &a);
+			if (err._) { break; }
+
+			if (*constant && isnil(tail)) {
+				tail = a;
+			} else if (!*constant
+				   && quasiquote_form(tail, sym_append)) {
+				tail = cons(sym_append, cons(a, cdr(tail)));
+			} else {
+				tail = cons(sym_append,
+					    cons(a,
+						 cons(quasiquote_quote(
+							  tail, *constant),
+						      nil)));
 			}
 
-			break;
+			*constant = false;
+			continue;
 		}
-		default: return;
+
+		err = quasiquote_expand(car(h), &a, &c);
+		if (err._) { break; }
+
+		if (c && *constant) {
+			tail = h;
+			continue;
+		}
+
+		tail = cons(sym_cons,
+			    cons(quasiquote_quote(a, c),
+				 cons(quasiquote_quote(tail, *constant), nil)));
+		*constant = false;
 	}
+
+	vector_free(&cells);
+	*result = tail;
+	return err;
 }
 
 um_Error macex(um_Noun expr, um_Noun* result) {
+	um_Error err;
+
+	if (um_nest == UM_NEST_MAX) { return MakeErrorCode(ERROR_STACK); }
+
+	um_nest++;
+	err = macex_form(expr, result);
+	um_nest--;
+	return err;
+}
+
+um_Error macex_form(um_Noun expr, um_Noun* result) {
 	um_Error err = MakeErrorCode(OK);
-	um_Noun args, op, result2;
+	um_Noun args, op, result2, h, a;
 	um_Vector v_params;
+	um_MacexEntry* e;
+	size_t i, changed;
+	bool constant;
 	int ss;
 	cur_expr = expr;
 
 	if (expr.type != pair_t || !listp(expr)) {
 		*result = expr;
 		return MakeErrorCode(OK);
+	}
+
+	op = car(expr);
+	if (op.type == noun_t && op.value.symbol == sym_quote.value.symbol) {
+		*result = expr;
+		return MakeErrorCode(OK);
+	}
+
+	if (!macex_cache) {
+		macex_cache = (um_MacexEntry*)calloc(UM_MACEX_CACHE,
+						     sizeof(um_MacexEntry));
+	}
+
+	e = &macex_cache[(uintptr_t)expr.value.pair / sizeof(struct um_Pair)
+			 & (UM_MACEX_CACHE - 1)];
+	if (e->epoch == macex_epoch && e->form.value.pair == expr.value.pair) {
+		*result = e->expansion;
+		stack_add(*result);
+		return MakeErrorCode(OK);
+	}
+
+	ss = stack_size;
+	args = cdr(expr);
+
+	if (quasiquote_form(expr, sym_quasiquote)) {
+		err = quasiquote_operand(expr, &a);
+		if (!err._) { err = quasiquote_expand(a, &result2, &constant); }
+		if (!err._) {
+			result2 = quasiquote_quote(result2, constant);
+			err = macex(result2, result);
+		}
+	} else if (op.type == noun_t && !env_get(env, op.value.symbol, result)._
+		   && result->type == macro_t) {
+		op = *result;
+		op.type = closure_t;
+		macex_ran = true;
+
+		noun_to_vector(args, &v_params);
+		err = apply(op, &v_params, &result2);
+		vector_free(&v_params);
+		if (!err._) { err = macex(result2, result); }
 	} else {
-		ss = stack_size;
-		op = car(expr);
+		/* Forms are expanded in place of the originals only up to the
+		 * last one that changed, the rest of the list is shared */
+		vector_new(&v_params);
+		changed = 0;
+		for (h = expr; !err._ && !isnil(h); h = cdr(h)) {
+			a = car(h);
+			err = macex(a, result);
+			vector_add(&v_params, *result);
+			if (result->type != a.type
+			    || (a.type == pair_t
+				&& result->value.pair != a.value.pair)) {
+				changed = v_params.size;
+			}
+		}
 
-		if (op.type == noun_t
-		    && op.value.symbol == sym_quote.value.symbol) {
-			*result = expr;
-			return MakeErrorCode(OK);
+		for (h = expr, i = 0; i < changed; i++) { h = cdr(h); }
+		for (*result = h; !err._ && changed; changed--) {
+			*result = cons(v_params.data[changed - 1], *result);
 		}
 
-		args = cdr(expr);
+		vector_free(&v_params);
+	}
 
-		if (op.type == noun_t
-		    && !env_get(env, op.value.symbol, result)._
-		    && result->type == macro_t) {
+	if (err._) {
+		stack_restore(ss);
+		return err;
+	}
 
-			op = *result;
+	/* Expanding may have bumped the epoch, when a macro defined a macro */
+	e->form = expr;
+	e->expansion = *result;
+	e->epoch = macex_epoch;
+	stack_restore_add(ss, *result);
+	return MakeErrorCode(OK);
+}
 
-			op.type = closure_t;
+/* Printing keeps what is left to print on a stack of its own, so nesting is
+ * bounded by memory. Each item is text to append, a noun to print or, with
+ * rest set, the rest of a list followed by the bracket closing it */
+typedef struct {
+	um_Noun a;
+	const char* text;
+	bool rest;
+} um_PrintItem;
 
-			noun_to_vector(args, &v_params);
-			err = apply(op, &v_params, &result2);
-			if (err._) {
-				vector_free(&v_params);
-				stack_restore(ss);
-				return err;
-			}
+typedef struct {
+	char* s;
+	size_t size, capacity;
+	um_PrintItem* todo;
+	size_t todo_size, todo_capacity;
+} um_Printer;
+
+void printer_append(um_Printer* p, const char* text) {
+	size_t len = strlen(text);
+	if (p->size + len + 1 > p->capacity) {
+		p->capacity = (p->size + len + 1) * 2;
+		p->s = (char*)realloc(p->s, p->capacity);
+	}
 
-			err = macex(result2, result);
-			if (err._) {
-				vector_free(&v_params);
-				stack_restore(ss);
-				return err;
-			}
+	memcpy(p->s + p->size, text, len + 1);
+	p->size += len;
+}
 
-			vector_free(&v_params);
-			stack_restore_add(ss, *result);
-			return MakeErrorCode(OK);
-		} else {
+void printer_push(um_Printer* p, um_Noun a, const char* text, bool rest) {
+	if (p->todo_size == p->todo_capacity) {
+		p->todo_capacity = p->todo_capacity * 2 + 16;
+		p->todo = (um_PrintItem*)realloc(
+		    p->todo, p->todo_capacity * sizeof(um_PrintItem));
+	}
 
-			um_Noun expr2 = copy_list(expr);
-			um_Noun h;
-			for (h = expr2; !isnil(h); h = cdr(h)) {
-				err = macex(car(h), &car(h));
-				if (err._) {
-					stack_restore(ss);
-					return err;
-				}
-			}
+	p->todo[p->todo_size].a = a;
+	p->todo[p->todo_size].text = text;
+	p->todo[p->todo_size].rest = rest;
+	p->todo_size++;
+}
 
-			*result = expr2;
-			stack_restore_add(ss, *result);
-			return MakeErrorCode(OK);
-		}
+/* The reader shorthand a two element list prints as, if any */
+const char* print_prefix(um_Noun a) {
+	um_Noun op = car(a);
+	if (op.type != noun_t || cdr(a).type != pair_t
+	    || !isnil(cdr(cdr(a)))) {
+		return NULL;
 	}
+
+	if (op.value.symbol == sym_quote.value.symbol) { return "'"; }
+	if (op.value.symbol == sym_quasiquote.value.symbol) { return "`"; }
+	if (op.value.symbol == sym_unquote.value.symbol) { return ","; }
+	if (op.value.symbol == sym_unquote_splicing.value.symbol) {
+		return ",@";
+	}
+
+	return NULL;
 }
 
 char* to_string(um_Noun a, bool write) {
-	char *s = um_new_string(), *s2, buf[80];
-	um_Noun a2;
-	switch (a.type) {
-		case nil_t: append_string(&s, "Nil"); break;
-		case noreturn_t: break;
-		case pair_t: {
-			if (listp(a) && list_len(a) == 2
-			    && eq_h(car(a), sym_quote)) {
-				append_string(&s, "'");
-				s2 = to_string(car(cdr(a)), write);
-				append_string(&s, s2);
-				free(s2);
-			} else if (listp(a) && list_len(a) == 2
-				   && eq_h(car(a), sym_quasiquote)) {
-				append_string(&s, "`");
-				s2 = to_string(car(cdr(a)), write);
-				append_string(&s, s2);
-				free(s2);
-			} else if (listp(a) && list_len(a) == 2
-				   && eq_h(car(a), sym_unquote)) {
-				append_string(&s, ",");
-				s2 = to_string(car(cdr(a)), write);
-				append_string(&s, s2);
-				free(s2);
-			} else if (listp(a) && list_len(a) == 2
-				   && eq_h(car(a), sym_unquote_splicing)) {
-				append_string(&s, ",@");
-				s2 = to_string(car(cdr(a)), write);
-				append_string(&s, s2);
-				free(s2);
+	um_Printer p = {NULL, 0, 0, NULL, 0, 0};
+	um_PrintItem item;
+	const char* prefix;
+	char buf[80];
+
+	printer_append(&p, "");
+	printer_push(&p, a, NULL, false);
+	while (p.todo_size) {
+		item = p.todo[--p.todo_size];
+		a = item.a;
+		if (item.rest) {
+			if (isnil(a)) {
+				printer_append(&p, item.text);
+			} else if (a.type == pair_t) {
+				printer_append(&p, " ");
+				printer_push(&p, cdr(a), item.text, true);
+				printer_push(&p, car(a), NULL, false);
 			} else {
-				append_string(&s, "(");
-				s2 = to_string(car(a), write);
-				append_string(&s, s2);
-				free(s2);
-				a = cdr(a);
-				while (!isnil(a)) {
-					if (a.type == pair_t) {
-						append_string(&s, " ");
-						s2 = to_string(car(a), write);
-						append_string(&s, s2);
-						free(s2);
-						a = cdr(a);
-					} else {
-						append_string(&s, " . ");
-						s2 = to_string(a, write);
-						append_string(&s, s2);
-						free(s2);
-						break;
-					}
-				}
-
-				append_string(&s, ")");
+				printer_append(&p, " . ");
+				printer_push(&p, nil, item.text, false);
+				printer_push(&p, a, NULL, false);
 			}
 
-			break;
+			continue;
+		} else if (item.text) {
+			printer_append(&p, item.text);
+			continue;
 		}
-		case noun_t: append_string(&s, a.value.symbol); break;
-		case string_t:
-			if (write) append_string(&s, "\"");
-			append_string(&s, a.value.string->value);
-			if (write) append_string(&s, "\"");
-			break;
-		case real_t:
-			sprintf(buf, "%f", a.value.number);
-			append_string(&s, buf);
-			break;
-		case builtin_t:
-			(void*)a.value.builtin ? sprintf(buf, "Builtin")
-					       : sprintf(buf, "Internal");
 
-			append_string(&s, buf);
-			break;
-		case closure_t: {
-			a2 = cons(sym_fn, cdr(a));
-			s2 = to_string(a2, write);
-			append_string(&s, s2);
-			free(s2);
-			break;
-		}
-		case macro_t:
-			append_string(&s, "Macro:");
-			s2 = to_string(cdr(a), write);
-			append_string(&s, s2);
-			free(s2);
-			append_string(&s, ">");
-			break;
-		case input_t: append_string(&s, "Input"); break;
-		case output_t: append_string(&s, "Output"); break;
-		case type_t:
-			append_string(&s, "@");
-			append_string(&s, type_to_string(a.value.type_v));
-			break;
-		case bool_t:
-			append_string(&s, a.value.bool_v ? "True" : "False");
-			break;
-		case error_t:
-			append_string(&s, error_to_string(a.value.error_v));
-			break;
-		case vector_t: {
-			char* l = to_string(vector_to_noun(a.value.vector_v, 0),
-					    write);
-			append_string(&s, l);
-			s[0] = '[';
-			s[strlen(s) - 1] = ']';
+		switch (a.type) {
+			case nil_t: printer_append(&p, "Nil"); break;
+			case noreturn_t: break;
+			case pair_t:
+				prefix = print_prefix(a);
+				if (prefix) {
+					printer_append(&p, prefix);
+					printer_push(
+					    &p, car(cdr(a)), NULL, false);
+				} else {
+					printer_append(&p, "(");
+					printer_push(&p, cdr(a), ")", true);
+					printer_push(&p, car(a), NULL, false);
+				}
 
-			break;
+				break;
+			case noun_t: printer_append(&p, a.value.symbol); break;
+			case string_t:
+				if (write) printer_append(&p, "\"");
+				printer_append(&p, a.value.string->value);
+				if (write) printer_append(&p, "\"");
+				break;
+			case real_t:
+				sprintf(buf, "%f", a.value.number);
+				printer_append(&p, buf);
+				break;
+			case integer_t:
+				sprintf(buf, "%lld", (long long)a.value.integer);
+				printer_append(&p, buf);
+				break;
+			case builtin_t:
+				printer_append(&p,
+					       (void*)a.value.builtin
+						   ? "Builtin"
+						   : "Internal");
+				break;
+			case closure_t:
+				printer_push(&p,
+					     cons(sym_fn,
+						  cons(car(cdr(a)),
+						       cons(car(cdr(cdr(a))),
+							    nil))),
+					     NULL,
+					     false);
+				break;
+			case macro_t:
+				printer_append(&p, "Macro:");
+				printer_push(&p, nil, ">", false);
+				printer_push(&p,
+					     cons(car(cdr(a)),
+						  cons(car(cdr(cdr(a))), nil)),
+					     NULL,
+					     false);
+				break;
+			case input_t: printer_append(&p, "Input"); break;
+			case table_t: printer_append(&p, "Table"); break;
+			case output_t: printer_append(&p, "Output"); break;
+			case type_t:
+				printer_append(&p, "@");
+				printer_append(&p,
+					       type_to_string(a.value.type_v));
+				break;
+			case bool_t:
+				printer_append(&p,
+					       a.value.bool_v ? "True"
+							      : "False");
+				break;
+			case error_t: {
+				char* e = error_to_string(
+				    MakeErrorCode(a.value.error_v));
+				printer_append(&p, e);
+				free(e);
+				break;
+			}
+			case vector_t:
+				a = vector_to_noun(a.value.vector_v, 0);
+				if (isnil(a)) {
+					printer_append(&p, "[]");
+				} else {
+					printer_append(&p, "[");
+					printer_push(&p, cdr(a), "]", true);
+					printer_push(&p, car(a), NULL, false);
+				}
+
+				break;
+			default: printer_append(&p, ":Unknown"); break;
 		}
-		default: append_string(&s, ":Unknown"); break;
 	}
 
-	return s;
+	free(p.todo);
+	return p.s;
 }
 
 char* append_string(char** dst, char* src) {
@@ -2101,15 +5422,22 @@ bool eq_pair_l(um_Noun a, um_Noun b) {
 bool eq_pair_h(um_Noun a, um_Noun b) {
 	if (a.type != pair_t || b.type != pair_t) { return false; }
 
-	return eq_h(car(a), car(b)) && eq_h(cdr(a), cdr(b));
+	return eq_h(a, b);
 }
 
-bool eq_h(um_Noun a, um_Noun b) {
-	if (a.type != b.type) { return false; }
+/* Compares nouns that are not made of pairs */
+bool eq_atom_h(um_Noun a, um_Noun b) {
+	/* Integers and floats holding the same value are equal */
+	if (a.type != b.type) {
+		return isnumber(a) && isnumber(b)
+		    && cast(a, real_t).value.number
+			   == cast(b, real_t).value.number;
+	}
 
 	switch (a.type) {
 		case nil_t: return isnil(a) && isnil(b);
 		case real_t: return a.value.number == b.value.number;
+		case integer_t: return a.value.integer == b.value.integer;
 		/* Equal symbols share memory */
 		case noun_t: return a.value.symbol == b.value.symbol;
 		case string_t:
@@ -2120,15 +5448,51 @@ bool eq_h(um_Noun a, um_Noun b) {
 		case output_t: return a.value.fp == b.value.fp;
 		case type_t: return a.value.type_v == b.value.type_v;
 		case bool_t: return a.value.bool_v == b.value.bool_v;
-		case error_t: return a.value.error_v._ == b.value.error_v._;
-		case pair_t:
-		case macro_t:
-		case closure_t:
-			return eq_pair_h(a, b); /* Frequently recursive */
+		case error_t: return a.value.error_v == b.value.error_v;
 		default: return false;
 	}
 }
 
+bool eq_h(um_Noun a, um_Noun b) {
+	/* The cdrs still to compare once the cars are, in pairs */
+	um_Noun local[32], *todo = local;
+	size_t size = 0, capacity = 32;
+	bool r;
+
+	for (;;) {
+		if (a.type == b.type
+		    && (a.type == pair_t || a.type == macro_t
+			|| a.type == closure_t)) {
+			if (size == capacity) {
+				capacity *= 2;
+				if (todo == local) {
+					todo = (um_Noun*)malloc(
+					    capacity * sizeof(um_Noun));
+					memcpy(todo, local, sizeof(local));
+				} else {
+					todo = (um_Noun*)realloc(
+					    todo, capacity * sizeof(um_Noun));
+				}
+			}
+
+			todo[size++] = cdr(a);
+			todo[size++] = cdr(b);
+			a = car(a);
+			b = car(b);
+			continue;
+		}
+
+		r = eq_atom_h(a, b);
+		if (!r || !size) { break; }
+
+		b = todo[--size];
+		a = todo[--size];
+	}
+
+	if (todo != local) { free(todo); }
+	return r;
+}
+
 bool eq_l(um_Noun a, um_Noun b) {
 	if (a.type == b.type) {
 		return eq_h(a, b);
@@ -2138,17 +5502,26 @@ bool eq_l(um_Noun a, um_Noun b) {
 }
 
 size_t hash_code(um_Noun a) {
+	return hash_code_nested(a, 0);
+}
+
+/* Lists nested deeper than UM_HASH_DEPTH hash alike, which keeps hashing off
+ * the C stack and still agrees with eq_h */
+#define UM_HASH_DEPTH 32
+size_t hash_code_nested(um_Noun a, size_t depth) {
 	size_t r = 1;
 	switch (a.type) {
 		case nil_t: return 0;
 		case pair_t:
+			if (depth == UM_HASH_DEPTH) { return r; }
+
 			while (!isnil(a)) {
 				r *= 31;
 				if (a.type == pair_t) {
-					r += hash_code(car(a));
+					r += hash_code_nested(car(a), depth + 1);
 					a = cdr(a);
 				} else {
-					r += hash_code(a);
+					r += hash_code_nested(a, depth + 1);
 					break;
 				}
 			}
@@ -2165,11 +5538,19 @@ size_t hash_code(um_Noun a) {
 			return r;
 		}
 		case real_t:
+			/* Hash whole floats like the integer they equal */
+			if (real_fits_integer(a.value.number)
+			    && a.value.number
+				   == (double)(int64_t)a.value.number) {
+				return (size_t)(int64_t)a.value.number;
+			}
+
 			return (size_t)((void*)a.value.symbol)
 			     + (size_t)a.value.number;
+		case integer_t: return (size_t)a.value.integer;
 		case builtin_t: return (size_t)a.value.builtin;
-		case closure_t: return hash_code(cdr(a));
-		case macro_t: return hash_code(cdr(a));
+		case closure_t:
+		case macro_t: return hash_code_nested(cdr(a), depth);
 		case input_t:
 		case output_t: return (size_t)a.value.fp / sizeof(*a.value.fp);
 		default: return 0;
@@ -2184,19 +5565,16 @@ um_Noun new_table(size_t capacity) {
 	um_Noun a;
 	um_Table* s;
 	size_t i;
-	alloc_count++;
-	s = a.value.table = calloc(1, sizeof(um_Table));
+	s = a.value.table = (um_Table*)heap_alloc(HEAP_TABLE);
 	s->capacity = capacity;
 	s->size = 0;
 	s->data = calloc(capacity, sizeof(um_TableEntry*));
 	for (i = 0; i < capacity; i++) { s->data[i] = NULL; }
 
-	s->mark = 0;
-	s->next = table_head;
-	table_head = s;
 	a.value.table = s;
 	a.type = table_t;
 	stack_add(a);
+	garbage_collector_young(a);
 	return a;
 }
 
@@ -2216,14 +5594,14 @@ void table_add(um_Table* tbl, um_Noun k, um_Noun v) {
 		data2 = calloc(new_capacity, sizeof(um_TableEntry*));
 		for (i = 0; i < new_capacity; i++) { data2[i] = NULL; }
 
+		/* Entries are relinked rather than copied, code may hold on
+		 * to them */
 		for (i = 0; i < tbl->capacity; i++) {
-			p = tbl->data[i];
-			while (p) {
+			for (p = tbl->data[i]; p; p = next) {
 				p2 = &data2[hash_code(p->k) % new_capacity];
 				next = p->next;
-				*p2 = table_entry_new(p->k, p->v, *p2);
-				free(p);
-				p = next;
+				p->next = *p2;
+				*p2 = p;
 			}
 		}
 
@@ -2237,6 +5615,16 @@ void table_add(um_Table* tbl, um_Noun k, um_Noun v) {
 	tbl->size++;
 }
 
+um_TableEntry* table_get(um_Table* tbl, um_Noun k) {
+	um_TableEntry* p;
+	if (tbl->size == 0) { return NULL; }
+	for (p = tbl->data[hash_code(k) % tbl->capacity]; p; p = p->next) {
+		if (eq_h(p->k, k)) { return p; }
+	}
+
+	return NULL;
+}
+
 um_TableEntry* table_get_sym(um_Table* tbl, char* k) {
 	um_TableEntry* p;
 	size_t pos;
@@ -2254,6 +5642,9 @@ um_TableEntry* table_get_sym(um_Table* tbl, char* k) {
 um_Error table_set_sym(um_Table* tbl, char* k, um_Noun v) {
 	um_TableEntry* p = table_get_sym(tbl, k);
 	um_Noun s = {noun_t, .value.symbol = NULL};
+	um_Noun t = {table_t, .value.table = tbl};
+	garbage_collector_barrier(t, p ? p->v : nil, v);
+	macex_forget(p, v);
 	if (p) {
 		if (!p->v.mut) { return MakeErrorCode(ERROR_NOMUT); }
 		p->v = v;
@@ -2273,8 +5664,9 @@ um_Error builtin_type(um_Vector* v_params, um_Noun* result) {
 }
 
 um_Error builtin_getlist(um_Vector* v_params, um_Noun* result) {
+	size_t index;
 	if (v_params->size != 2) { return MakeErrorCode(ERROR_ARGS); }
-	if (v_params->data[0].type != real_t) {
+	if (!isnumber(v_params->data[0])) {
 		return MakeError(
 		    ERROR_TYPE,
 		    "list_index: first parameter must be number type");
@@ -2285,20 +5677,18 @@ um_Error builtin_getlist(um_Vector* v_params, um_Noun* result) {
 		    "list_index: second parameter must be list or vector");
 	}
 
-	if (v_params->data[1].type != vector_t) {
-		*result = v_params->data[1]
-			      .value.vector_v
-			      ->data[(size_t)v_params->data[0].value.number];
+	index = cast(v_params->data[0], integer_t).value.integer;
+	if (v_params->data[1].type == vector_t) {
+		*result = v_params->data[1].value.vector_v->data[index];
 	} else {
-		*result = *list_index(&v_params->data[1],
-				      (size_t)v_params->data[0].value.number);
+		*result = *list_index(&v_params->data[1], index);
 	}
 	return MakeErrorCode(OK);
 }
 
 um_Error builtin_setlist(um_Vector* v_params, um_Noun* result) {
 	if (v_params->size != 3) { return MakeErrorCode(ERROR_ARGS); }
-	if (v_params->data[0].type != real_t) {
+	if (!isnumber(v_params->data[0])) {
 		return MakeError(
 		    ERROR_TYPE,
 		    "list_index: first parameter must be number type");
@@ -2307,10 +5697,10 @@ um_Error builtin_setlist(um_Vector* v_params, um_Noun* result) {
 		return MakeError(ERROR_TYPE,
 				 "list_index: second parameter must be list");
 	}
-	um_Noun t = copy_list(v_params->data[1]);
-	um_Noun* i = list_index(&t, v_params->data[0].value.number);
-	i->type = v_params->data[2].type;
-	i->value = v_params->data[2].value;
+	um_Noun t = copy_list(v_params->data[1]), c = t;
+	size_t i, index = cast(v_params->data[0], integer_t).value.integer;
+	for (i = 0; i < index && !isnil(c); i++) { pop(c); }
+	if (!isnil(c)) { set_car(c, v_params->data[2]); }
 	*result = t;
 	return MakeErrorCode(OK);
 }
@@ -2319,104 +5709,355 @@ um_Error builtin_len(um_Vector* v_params, um_Noun* result) {
 	if (v_params->size != 1) { return MakeErrorCode(ERROR_ARGS); }
 
 	if (listp(v_params->data[0])) {
-		*result = new ((double)list_len(v_params->data[0]));
+		*result = new ((int64_t)list_len(v_params->data[0]));
 	} else if (v_params->data[0].type == string_t) {
 		*result = new (
-		    (double)strlen(v_params->data[0].value.string->value));
+		    (int64_t)strlen(v_params->data[0].value.string->value));
 	} else if (v_params->data[0].type == vector_t) {
 
-		*result = new ((double)v_params->data[0].value.vector_v->size);
+		*result = new ((int64_t)v_params->data[0].value.vector_v->size);
+	} else {
+		*result = new ((int64_t)0);
+		return MakeErrorCode(ERROR_TYPE);
+	}
+
+	return MakeErrorCode(OK);
+}
+
+um_Error builtin_range(um_Vector* v_params, um_Noun* result) {
+	if (v_params->size > 2 || v_params->size < 1) {
+		return MakeError(ERROR_ARGS,
+				 "range: arg count must be nonzero below 3");
+	}
+
+	if (!isnumber(v_params->data[0])
+	    || (v_params->size > 1 && !isnumber(v_params->data[1]))) {
+		return MakeError(ERROR_TYPE,
+				 "range: args must be type numeric");
+	}
+
+	um_Noun range = nil;
+
+	if (v_params->data[0].type == integer_t
+	    && (v_params->size == 1 || v_params->data[1].type == integer_t)) {
+		int64_t a = v_params->size > 1 ? v_params->data[0].value.integer
+					       : 0,
+			b = v_params->data[v_params->size - 1].value.integer;
+
+		if (a < b) {
+			for (; a <= b; b--) { range = cons(new (b), range); }
+		} else {
+			for (; a >= b; b++) { range = cons(new (b), range); }
+		}
+
+		*result = range;
+		return MakeErrorCode(OK);
+	}
+
+	double a = v_params->size > 1
+		     ? cast(v_params->data[0], real_t).value.number
+		     : 0,
+	       b = v_params->size > 1
+		     ? cast(v_params->data[1], real_t).value.number
+		     : cast(v_params->data[0], real_t).value.number;
+
+	if (a < b) {
+		for (; a <= b; b--) { range = cons(new (b), range); }
+	} else {
+		for (; a >= b; b++) { range = cons(new (b), range); }
+	}
+
+	*result = range;
+	return MakeErrorCode(OK);
+}
+
+um_Error builtin_car(um_Vector* v_params, um_Noun* result) {
+	um_Noun a;
+	if (v_params->size != 1) { return MakeErrorCode(ERROR_ARGS); }
+
+	a = v_params->data[0];
+	if (isnil(a)) {
+		*result = nil;
+	} else if (a.type != pair_t) {
+		return MakeErrorCode(ERROR_TYPE);
+	} else {
+		*result = car(a);
+	}
+
+	return MakeErrorCode(OK);
+}
+
+um_Error builtin_cdr(um_Vector* v_params, um_Noun* result) {
+	um_Noun a;
+	if (v_params->size != 1) { return MakeErrorCode(ERROR_ARGS); }
+
+	a = v_params->data[0];
+	if (isnil(a)) {
+		*result = nil;
+	} else if (a.type != pair_t) {
+		return MakeErrorCode(ERROR_TYPE);
+	} else {
+		*result = cdr(a);
+	}
+
+	return MakeErrorCode(OK);
+}
+
+um_Error builtin_cons(um_Vector* v_params, um_Noun* result) {
+	if (v_params->size != 2) { return MakeErrorCode(ERROR_ARGS); }
+
+	*result = cons(v_params->data[0], v_params->data[1]);
+
+	return MakeErrorCode(OK);
+}
+
+um_Error builtin_apply(um_Vector* v_params, um_Noun* result) {
+	um_Noun fn;
+	um_Vector v;
+	um_Error err;
+
+	if (v_params->size != 2) { return MakeErrorCode(ERROR_ARGS); }
+	if (!listp(v_params->data[1])) { return MakeErrorCode(ERROR_TYPE); }
+
+	fn = v_params->data[0];
+	noun_to_vector(v_params->data[1], &v);
+	err = apply(fn, &v, result);
+	vector_free(&v);
+	return err;
+}
+
+/* The list builtins below take the place of Lisp definitions, so missing
+ * arguments are nil just as they would have been */
+um_Noun builtin_arg(um_Vector* v_params, size_t i) {
+	return i < v_params->size ? v_params->data[i] : nil;
+}
+
+um_Error builtin_call(um_Noun fn, um_Noun* args, size_t n, um_Noun* result) {
+	um_Vector v;
+	v.data = args;
+	v.size = v.capacity = n;
+	return apply(fn, &v, result);
+}
+
+/* Appends a to the list being built from *head to *tail */
+void builtin_collect(um_Noun* head, um_Noun* tail, um_Noun a) {
+	um_Noun p = cons(a, nil);
+	if (isnil(*head)) {
+		*head = p;
+	} else {
+		set_cdr(*tail, p);
+	}
+
+	*tail = p;
+}
+
+/* Calls p with each element of l and the result so far, last element first,
+ * starting from i */
+um_Error builtin_fold_right(um_Noun p, um_Noun i, um_Noun l, um_Noun* result) {
+	um_Noun args[2];
+	um_Vector v;
+	um_Error err = MakeErrorCode(OK);
+	size_t ss = stack_size;
+
+	vector_new(&v);
+	for (; !isnil(l); l = cdr(l)) {
+		if (l.type != pair_t) {
+			vector_free(&v);
+			return MakeErrorCode(ERROR_TYPE);
+		}
+
+		vector_add(&v, car(l));
+	}
+
+	*result = i;
+	while (v.size) {
+		args[0] = v.data[--v.size];
+		args[1] = *result;
+		err = builtin_call(p, args, 2, result);
+		if (err._) { break; }
+
+		stack_restore_add(ss, *result);
+	}
+
+	vector_free(&v);
+	return err;
+}
+
+um_Error builtin_foldl(um_Vector* v_params, um_Noun* result) {
+	um_Noun proc = builtin_arg(v_params, 0), l = builtin_arg(v_params, 2);
+	um_Noun args[2];
+	um_Error err;
+	size_t ss = stack_size;
+
+	if (v_params->size > 3) { return MakeErrorCode(ERROR_ARGS); }
+
+	*result = builtin_arg(v_params, 1);
+	for (; !isnil(l); l = cdr(l)) {
+		if (l.type != pair_t) { return MakeErrorCode(ERROR_TYPE); }
+
+		args[0] = *result;
+		args[1] = car(l);
+		err = builtin_call(proc, args, 2, result);
+		if (err._) { return err; }
+
+		stack_restore_add(ss, *result);
+	}
+
+	return MakeErrorCode(OK);
+}
+
+um_Error builtin_foldr(um_Vector* v_params, um_Noun* result) {
+	if (v_params->size > 3) { return MakeErrorCode(ERROR_ARGS); }
+
+	return builtin_fold_right(builtin_arg(v_params, 0),
+				  builtin_arg(v_params, 1),
+				  builtin_arg(v_params, 2),
+				  result);
+}
+
+/* Copies each list but the last, which the result ends in */
+um_Error builtin_append(um_Vector* v_params, um_Noun* result) {
+	um_Noun tail = nil, l;
+	size_t i, ss = stack_size;
+
+	*result = nil;
+	for (i = 0; i + 1 < v_params->size; i++) {
+		for (l = v_params->data[i]; !isnil(l); l = cdr(l)) {
+			if (l.type != pair_t) {
+				return MakeErrorCode(ERROR_TYPE);
+			}
+
+			builtin_collect(result, &tail, car(l));
+			stack_restore_add(ss, *result);
+		}
+	}
+
+	l = builtin_arg(v_params, i);
+	if (isnil(*result)) {
+		*result = l;
 	} else {
-		*result = new ((double)0);
-		return MakeErrorCode(ERROR_TYPE);
+		set_cdr(tail, l);
 	}
 
 	return MakeErrorCode(OK);
 }
 
-um_Error builtin_range(um_Vector* v_params, um_Noun* result) {
-	if (v_params->size > 2 || v_params->size < 1) {
-		return MakeError(ERROR_ARGS,
-				 "range: arg count must be nonzero below 3");
-	}
+um_Error builtin_reduce(um_Vector* v_params, um_Noun* result) {
+	if (v_params->size > 3) { return MakeErrorCode(ERROR_ARGS); }
 
-	if (v_params->data[0].type != real_t
-	    || (v_params->size > 1 && v_params->data[1].type != real_t)) {
-		return MakeError(ERROR_TYPE,
-				 "range: args must be type numeric");
-	}
+	return builtin_fold_right(builtin_arg(v_params, 0),
+				  builtin_arg(v_params, 2),
+				  builtin_arg(v_params, 1),
+				  result);
+}
 
-	double a = v_params->size > 1
-		     ? cast(v_params->data[0], real_t).value.number
-		     : 0,
-	       b = v_params->size > 1
-		     ? cast(v_params->data[1], real_t).value.number
-		     : cast(v_params->data[0], real_t).value.number;
+um_Error builtin_unary_map(um_Vector* v_params, um_Noun* result) {
+	um_Noun proc = builtin_arg(v_params, 0), l = builtin_arg(v_params, 1);
+	um_Noun tail = nil, r;
+	um_Error err;
+	size_t ss = stack_size;
 
-	um_Noun range = nil;
+	if (v_params->size > 2) { return MakeErrorCode(ERROR_ARGS); }
 
-	if (a < b) {
-		for (; a <= b; b--) { range = cons(new (b), range); }
-	} else {
-		for (; a >= b; b++) { range = cons(new (b), range); }
+	*result = nil;
+	for (; !isnil(l); l = cdr(l)) {
+		if (l.type != pair_t) { return MakeErrorCode(ERROR_TYPE); }
+
+		err = builtin_call(proc, &car(l), 1, &r);
+		if (err._) { return err; }
+
+		builtin_collect(result, &tail, r);
+		stack_restore_add(ss, *result);
 	}
 
-	*result = range;
 	return MakeErrorCode(OK);
 }
 
-um_Error builtin_car(um_Vector* v_params, um_Noun* result) {
-	um_Noun a;
-	if (v_params->size != 1) { return MakeErrorCode(ERROR_ARGS); }
+/* Calls proc with the first elements of each list, then the second ones and
+ * so on, leaving out lists as they run out, until they all have */
+um_Error builtin_map(um_Vector* v_params, um_Noun* result) {
+	um_Noun proc = builtin_arg(v_params, 0), tail = nil, r;
+	um_Vector lists, args;
+	um_Error err = MakeErrorCode(OK);
+	size_t ss = stack_size, i;
 
-	a = v_params->data[0];
-	if (isnil(a)) {
-		*result = nil;
-	} else if (a.type != pair_t) {
-		return MakeErrorCode(ERROR_TYPE);
-	} else {
-		*result = car(a);
+	*result = nil;
+	vector_new(&lists);
+	vector_new(&args);
+	for (i = 1; i < v_params->size; i++) {
+		vector_add(&lists, v_params->data[i]);
 	}
 
-	return MakeErrorCode(OK);
-}
+	for (;;) {
+		vector_clear(&args);
+		for (i = 0; i < lists.size; i++) {
+			if (isnil(lists.data[i])) { continue; }
 
-um_Error builtin_cdr(um_Vector* v_params, um_Noun* result) {
-	um_Noun a;
-	if (v_params->size != 1) { return MakeErrorCode(ERROR_ARGS); }
+			if (lists.data[i].type != pair_t) {
+				err = MakeErrorCode(ERROR_TYPE);
+				goto done;
+			}
 
-	a = v_params->data[0];
-	if (isnil(a)) {
-		*result = nil;
-	} else if (a.type != pair_t) {
-		return MakeErrorCode(ERROR_TYPE);
-	} else {
-		*result = cdr(a);
+			vector_add(&args, car(lists.data[i]));
+			lists.data[i] = cdr(lists.data[i]);
+		}
+
+		if (!args.size) { break; }
+
+		err = apply(proc, &args, &r);
+		if (err._) { goto done; }
+
+		builtin_collect(result, &tail, r);
+		stack_restore_add(ss, *result);
 	}
 
-	return MakeErrorCode(OK);
+done:
+	vector_free(&lists);
+	vector_free(&args);
+	return err;
 }
 
-um_Error builtin_cons(um_Vector* v_params, um_Noun* result) {
-	if (v_params->size != 2) { return MakeErrorCode(ERROR_ARGS); }
+um_Error builtin_filter(um_Vector* v_params, um_Noun* result) {
+	um_Noun pred = builtin_arg(v_params, 0), l = builtin_arg(v_params, 1);
+	um_Noun tail = nil, r;
+	um_Error err;
+	size_t ss = stack_size;
 
-	*result = cons(v_params->data[0], v_params->data[1]);
+	if (v_params->size > 2) { return MakeErrorCode(ERROR_ARGS); }
+
+	*result = nil;
+	for (; !isnil(l); l = cdr(l)) {
+		if (l.type != pair_t) { return MakeErrorCode(ERROR_TYPE); }
+
+		err = builtin_call(pred, &car(l), 1, &r);
+		if (err._) { return err; }
+
+		if (um_truthy(r)) { builtin_collect(result, &tail, car(l)); }
+		stack_restore_add(ss, *result);
+	}
 
 	return MakeErrorCode(OK);
 }
 
-um_Error builtin_apply(um_Vector* v_params, um_Noun* result) {
-	um_Noun fn;
-	um_Vector v;
+um_Error builtin_for_each(um_Vector* v_params, um_Noun* result) {
+	um_Noun proc = builtin_arg(v_params, 0), l = builtin_arg(v_params, 1);
 	um_Error err;
+	size_t ss = stack_size;
 
-	if (v_params->size != 2) { return MakeErrorCode(ERROR_ARGS); }
+	if (v_params->size > 2) { return MakeErrorCode(ERROR_ARGS); }
 
-	fn = v_params->data[0];
-	noun_to_vector(v_params->data[1], &v);
-	err = apply(fn, &v, result);
-	vector_free(&v);
-	return err;
+	for (; !isnil(l); l = cdr(l)) {
+		if (l.type != pair_t) { return MakeErrorCode(ERROR_TYPE); }
+
+		err = builtin_call(proc, &car(l), 1, result);
+		if (err._) { return err; }
+
+		stack_restore(ss);
+	}
+
+	/* What _ is bound to, which the prelude version ended in */
+	*result = um_noreturn;
+	return MakeErrorCode(OK);
 }
 
 um_Error builtin_eq(um_Vector* v_params, um_Noun* result) {
@@ -2504,17 +6145,35 @@ um_Error builtin_macex(um_Vector* v_params, um_Noun* result) {
 }
 
 um_Error builtin_vector(um_Vector* v_params, um_Noun* result) {
-	um_Vector v;
 	size_t i;
 
-	vector_new(&v);
+	*result = new_vector();
 	for (i = 0; i < v_params->size; i++) {
-		if (!isnil(v_params->data[i])) {
-			vector_add(&v, v_params->data[i]);
+		vector_add(result->value.vector_v, v_params->data[i]);
+	}
+
+	return MakeErrorCode(OK);
+}
+
+/* Makes a table of alternating keys and values */
+um_Error builtin_table(um_Vector* v_params, um_Noun* result) {
+	um_TableEntry* e;
+	size_t i;
+
+	if (v_params->size % 2) { return MakeErrorCode(ERROR_ARGS); }
+
+	*result = new_table(v_params->size / 2 + 1);
+	for (i = 0; i < v_params->size; i += 2) {
+		e = table_get(result->value.table, v_params->data[i]);
+		if (e) {
+			e->v = v_params->data[i + 1];
+		} else {
+			table_add(result->value.table,
+				  v_params->data[i],
+				  v_params->data[i + 1]);
 		}
 	}
 
-	*result = new_vector(&v);
 	return MakeErrorCode(OK);
 }
 
@@ -2577,6 +6236,16 @@ um_Error builtin_float(um_Vector* v_params, um_Noun* result) {
 	}
 }
 
+um_Error builtin_integer(um_Vector* v_params, um_Noun* result) {
+	if (v_params->size == 1) {
+		*result = cast(v_params->data[0], integer_t);
+
+		return MakeErrorCode(OK);
+	} else {
+		return MakeErrorCode(ERROR_ARGS);
+	}
+}
+
 um_Error builtin_and(um_Vector* v_params, um_Noun* result) {
 	if (v_params->size != 2) { return MakeErrorCode(ERROR_ARGS); }
 
@@ -2667,94 +6336,305 @@ um_Error builtin_cbrt(um_Vector* v_params, um_Noun* result) {
 	return MakeErrorCode(OK);
 }
 
-um_Error builtin_add(um_Vector* v_params, um_Noun* result) {
-	size_t ac = v_params->size;
-	um_Noun a0 = v_params->data[0], a1 = v_params->data[1];
-	if (ac == 1) {
-		*result = new (fabs(a0.value.number));
-		return MakeErrorCode(OK);
-	} else if (ac > 2 || ac < 1) {
-		return MakeErrorCode(ERROR_ARGS);
+/* With more than two operands, (op a b c) is (op (op a b) c) */
+um_Error builtin_arithmetic(um_Vector* v_params,
+			    um_Noun (*op)(um_Noun, um_Noun),
+			    um_Noun* result) {
+	size_t i;
+	if (v_params->size < 2) { return MakeErrorCode(ERROR_ARGS); }
+
+	*result = v_params->data[0];
+	for (i = 1; i < v_params->size; i++) {
+		*result = op(*result, v_params->data[i]);
 	}
 
-	double _temp
-	    = cast(a0, real_t).value.number + cast(a1, real_t).value.number;
+	return MakeErrorCode(OK);
+}
 
-	*result = new (_temp);
+um_Error builtin_add(um_Vector* v_params, um_Noun* result) {
+	um_Noun a0;
+	if (v_params->size == 1) {
+		a0 = v_params->data[0];
+		*result = a0.type == integer_t && a0.value.integer != INT64_MIN
+			    ? new ((int64_t)llabs(a0.value.integer))
+			    : new (fabs(real_operand(a0)));
+		return MakeErrorCode(OK);
+	}
 
-	return MakeErrorCode(OK);
+	return builtin_arithmetic(v_params, number_add, result);
 }
 
 um_Error builtin_subtract(um_Vector* v_params, um_Noun* result) {
-	size_t ac = v_params->size;
-	um_Noun a0 = v_params->data[0], a1 = v_params->data[1];
-	if (ac == 1) {
-		*result = new (-fabs(a0.value.number));
+	um_Noun a0;
+	if (v_params->size == 1) {
+		a0 = v_params->data[0];
+		*result = a0.type == integer_t && a0.value.integer != INT64_MIN
+			    ? new ((int64_t)-llabs(a0.value.integer))
+			    : new (-fabs(real_operand(a0)));
 		return MakeErrorCode(OK);
-	} else if (ac > 2 || ac < 1) {
-		return MakeErrorCode(ERROR_ARGS);
 	}
 
-	double _temp
-	    = cast(a0, real_t).value.number - cast(a1, real_t).value.number;
-
-	*result = new (_temp);
-	return MakeErrorCode(OK);
+	return builtin_arithmetic(v_params, number_subtract, result);
 }
 
 um_Error builtin_modulo(um_Vector* v_params, um_Noun* result) {
 	um_Noun a0 = v_params->data[0], a1 = v_params->data[1];
 	if (v_params->size != 2) { return MakeErrorCode(ERROR_ARGS); }
 
-	double _temp = (long)cast(a0, real_t).value.number
-		     % (long)cast(a1, real_t).value.number;
+	if (integer_operands(a0, a1) && a1.value.integer != 0) {
+		*result = new ((int64_t)(a1.value.integer == -1
+					     ? 0
+					     : a0.value.integer
+						   % a1.value.integer));
+		return MakeErrorCode(OK);
+	}
 
-	*result = new (_temp);
+	*result = new (fmod(real_operand(a0), real_operand(a1)));
 
 	return MakeErrorCode(OK);
 }
 
 um_Error builtin_multiply(um_Vector* v_params, um_Noun* result) {
-	um_Noun a0 = v_params->data[0], a1 = v_params->data[1];
-	if (v_params->size != 2) { return MakeErrorCode(ERROR_ARGS); }
+	return builtin_arithmetic(v_params, number_multiply, result);
+}
+
+um_Error builtin_divide(um_Vector* v_params, um_Noun* result) {
+	return builtin_arithmetic(v_params, number_divide, result);
+}
+
+/* Reductions gather the elements they combine in floating point into chunks
+ * of contiguous doubles, which the kernels go through UM_LANES at a time
+ * where the compiler has vector types. The lanes are combined at the end, so
+ * floating point results may differ from a sequential fold in the last bit */
+#define UM_CHUNK 256
+#define UM_LANES 4
+#ifdef __GNUC__
+typedef double um_Lanes __attribute__((vector_size(UM_LANES * 8)));
+#endif
+
+double kernel_sum(const double* x, size_t n) {
+	double r = 0;
+	size_t i = 0;
+#ifdef __GNUC__
+	um_Lanes acc = {0, 0, 0, 0}, a;
+	for (; i + UM_LANES <= n; i += UM_LANES) {
+		memcpy(&a, x + i, sizeof(a));
+		acc += a;
+	}
+
+	r = (acc[0] + acc[1]) + (acc[2] + acc[3]);
+#endif
+	for (; i < n; i++) { r += x[i]; }
+	return r;
+}
+
+double kernel_product(const double* x, size_t n) {
+	double r = 1;
+	size_t i = 0;
+#ifdef __GNUC__
+	um_Lanes acc = {1, 1, 1, 1}, a;
+	for (; i + UM_LANES <= n; i += UM_LANES) {
+		memcpy(&a, x + i, sizeof(a));
+		acc *= a;
+	}
+
+	r = (acc[0] * acc[1]) * (acc[2] * acc[3]);
+#endif
+	for (; i < n; i++) { r *= x[i]; }
+	return r;
+}
+
+double kernel_dot(const double* x, const double* y, size_t n) {
+	double r = 0;
+	size_t i = 0;
+#ifdef __GNUC__
+	um_Lanes acc = {0, 0, 0, 0}, a, b;
+	for (; i + UM_LANES <= n; i += UM_LANES) {
+		memcpy(&a, x + i, sizeof(a));
+		memcpy(&b, y + i, sizeof(b));
+		acc += a * b;
+	}
+
+	r = (acc[0] + acc[1]) + (acc[2] + acc[3]);
+#endif
+	for (; i < n; i++) { r += x[i] * y[i]; }
+	return r;
+}
+
+/* Sum, product or, given y, dot product of n nouns as doubles */
+double numbers_reduce(um_Noun* x, um_Noun* y, size_t n, bool product) {
+	double a[UM_CHUNK], b[UM_CHUNK], r = product ? 1 : 0;
+	size_t i, k;
+
+	for (; n; n -= k, x += k, y = y ? y + k : NULL) {
+		k = n < UM_CHUNK ? n : UM_CHUNK;
+		for (i = 0; i < k; i++) { a[i] = real_operand(x[i]); }
+
+		if (y) {
+			for (i = 0; i < k; i++) { b[i] = real_operand(y[i]); }
+			r += kernel_dot(a, b, k);
+		} else if (product) {
+			r *= kernel_product(a, k);
+		} else {
+			r += kernel_sum(a, k);
+		}
+	}
+
+	return r;
+}
+
+/* The elements of a list or vector, gathered in v when it is a list */
+um_Error builtin_elements(um_Noun a, um_Vector* v, um_Noun** data, size_t* n) {
+	vector_new(v);
+	if (a.type == vector_t) {
+		*data = a.value.vector_v->data;
+		*n = a.value.vector_v->size;
+		return MakeErrorCode(OK);
+	}
 
-	double _temp
-	    = cast(a0, real_t).value.number * cast(a1, real_t).value.number;
+	for (; !isnil(a); a = cdr(a)) {
+		if (a.type != pair_t) {
+			vector_free(v);
+			return MakeErrorCode(ERROR_TYPE);
+		}
 
-	*result = new (_temp);
+		vector_add(v, car(a));
+	}
 
+	*data = v->data;
+	*n = v->size;
 	return MakeErrorCode(OK);
 }
 
-um_Error builtin_divide(um_Vector* v_params, um_Noun* result) {
-	um_Noun a0 = v_params->data[0], a1 = v_params->data[1];
+/* Integers are added or multiplied exactly until one overflows or something
+ * else comes along, the rest are done in floating point */
+um_Error builtin_sum_product(um_Vector* v_params,
+			     bool product,
+			     um_Noun* result) {
+	um_Noun* a;
+	um_Vector v;
+	um_Error err;
+	int64_t r = product, t, x;
+	double rest;
+	size_t n, i;
+
+	if (v_params->size != 1) { return MakeErrorCode(ERROR_ARGS); }
+
+	err = builtin_elements(v_params->data[0], &v, &a, &n);
+	if (err._) { return err; }
+
+	for (i = 0; i < n && a[i].type == integer_t; i++) {
+		x = a[i].value.integer;
+		if (product ? __builtin_mul_overflow(r, x, &t)
+			    : __builtin_add_overflow(r, x, &t)) {
+			break;
+		}
+
+		r = t;
+	}
+
+	if (i == n) {
+		*result = new (r);
+	} else {
+		rest = numbers_reduce(a + i, NULL, n - i, product);
+		*result = new (product ? (double)r * rest : (double)r + rest);
+	}
+
+	vector_free(&v);
+	return MakeErrorCode(OK);
+}
+
+um_Error builtin_sum(um_Vector* v_params, um_Noun* result) {
+	return builtin_sum_product(v_params, false, result);
+}
+
+um_Error builtin_product(um_Vector* v_params, um_Noun* result) {
+	return builtin_sum_product(v_params, true, result);
+}
+
+/* The sum of the products of the elements of two lists or vectors, which must
+ * be as long as each other */
+um_Error builtin_dot(um_Vector* v_params, um_Noun* result) {
+	um_Noun *a, *b;
+	um_Vector v, w;
+	um_Error err;
+	int64_t r = 0, t, x;
+	size_t n, m, i;
+
 	if (v_params->size != 2) { return MakeErrorCode(ERROR_ARGS); }
 
-	double _temp
-	    = cast(a0, real_t).value.number / cast(a1, real_t).value.number;
+	err = builtin_elements(v_params->data[0], &v, &a, &n);
+	if (err._) { return err; }
+
+	err = builtin_elements(v_params->data[1], &w, &b, &m);
+	if (!err._ && n != m) { err = MakeErrorCode(ERROR_ARGS); }
+
+	for (i = 0; !err._ && i < n && integer_operands(a[i], b[i]); i++) {
+		x = a[i].value.integer;
+		if (__builtin_mul_overflow(x, b[i].value.integer, &t)
+		    || __builtin_add_overflow(r, t, &t)) {
+			break;
+		}
+
+		r = t;
+	}
+
+	if (!err._ && i == n) {
+		*result = new (r);
+	} else if (!err._) {
+		*result = new (
+		    (double)r + numbers_reduce(a + i, b + i, n - i, false));
+	}
+
+	vector_free(&v);
+	vector_free(&w);
+	return err;
+}
+
+/* The least or greatest element by <, the later of equal least ones and the
+ * earlier of equal greatest ones */
+um_Error builtin_extreme(um_Vector* v_params, bool greatest, um_Noun* result) {
+	um_Noun* a;
+	um_Vector v;
+	um_Error err;
+	size_t n, i;
+
+	if (v_params->size != 1) { return MakeErrorCode(ERROR_ARGS); }
+
+	err = builtin_elements(v_params->data[0], &v, &a, &n);
+	if (err._) { return err; }
 
-	*result = new (_temp);
+	*result = n ? a[0] : nil;
+	for (i = 1; i < n; i++) {
+		if (greatest ? number_less(*result, a[i]).value.bool_v
+			     : !number_less(*result, a[i]).value.bool_v) {
+			*result = a[i];
+		}
+	}
 
+	vector_free(&v);
 	return MakeErrorCode(OK);
 }
 
+um_Error builtin_min(um_Vector* v_params, um_Noun* result) {
+	return builtin_extreme(v_params, false, result);
+}
+
+um_Error builtin_max(um_Vector* v_params, um_Noun* result) {
+	return builtin_extreme(v_params, true, result);
+}
+
 um_Error builtin_less(um_Vector* v_params, um_Noun* result) {
-	um_Noun a0 = v_params->data[0], a1 = v_params->data[1];
 	if (v_params->size != 2) { return MakeErrorCode(ERROR_ARGS); }
 
-	*result = new ((bool)(cast(a0, real_t).value.number
-			      < cast(a1, real_t).value.number));
-
+	*result = number_less(v_params->data[0], v_params->data[1]);
 	return MakeErrorCode(OK);
 }
 
 um_Error builtin_greater(um_Vector* v_params, um_Noun* result) {
-	um_Noun a0 = v_params->data[0], a1 = v_params->data[1];
 	if (v_params->size != 2) { return MakeErrorCode(ERROR_ARGS); }
 
-	*result = new ((bool)(cast(a0, real_t).value.number
-			      > cast(a1, real_t).value.number));
-
+	*result = number_greater(v_params->data[0], v_params->data[1]);
 	return MakeErrorCode(OK);
 }
 
@@ -2762,7 +6642,9 @@ um_Error builtin_floor(um_Vector* v_params, um_Noun* result) {
 	um_Noun a0 = v_params->data[0];
 	if (v_params->size != 1) { return MakeErrorCode(ERROR_ARGS); }
 
-	*result = new (floor(cast(a0, real_t).value.number));
+	*result = a0.type == integer_t
+		    ? a0
+		    : new (floor(cast(a0, real_t).value.number));
 
 	return MakeErrorCode(OK);
 }
@@ -2771,7 +6653,9 @@ um_Error builtin_ceil(um_Vector* v_params, um_Noun* result) {
 	um_Noun a0 = v_params->data[0];
 	if (v_params->size != 1) { return MakeErrorCode(ERROR_ARGS); }
 
-	*result = new (ceil(cast(a0, real_t).value.number));
+	*result = a0.type == integer_t
+		    ? a0
+		    : new (ceil(cast(a0, real_t).value.number));
 
 	return MakeErrorCode(OK);
 }
@@ -2780,14 +6664,12 @@ um_Error builtin_hex(um_Vector* v_params, um_Noun* result) {
 	um_Noun a0 = v_params->data[0];
 	if (v_params->size != 1) { return MakeErrorCode(ERROR_ARGS); }
 
-	char* str = calloc(33, sizeof(char));
-	sprintf(str, "%x", (int32_t)cast(a0, real_t).value.number);
+	char* str = calloc(17, sizeof(char));
+	sprintf(str,
+		"%llx",
+		(unsigned long long)cast(a0, integer_t).value.integer);
 
-	char* tmp = strdup(str);
-
-	*result = new (tmp);
-
-	free(str);
+	*result = new (str);
 
 	return MakeErrorCode(OK);
 }
@@ -2848,13 +6730,23 @@ void um_init() {
 	srand((unsigned)time(0));
 	if (!um_global_symbol_capacity) { um_global_symbol_capacity = 1000; }
 	env = env_create(nil, um_global_symbol_capacity);
+	vm_stack = (um_Noun*)calloc(vm_stack_limit, sizeof(um_Noun));
 
-	symbol_table = calloc(um_global_symbol_capacity, sizeof(char*));
+	for (symbol_capacity = 16; symbol_capacity < um_global_symbol_capacity * 2;
+	     symbol_capacity *= 2) {}
+	symbol_table = calloc(symbol_capacity, sizeof(char*));
 
 	sym_quote = intern("quote");
 	sym_quasiquote = intern("quasiquote");
 	sym_unquote = intern("unquote");
 	sym_unquote_splicing = intern("unquote-splicing");
+	sym_append = intern("__builtin_append");
+	sym_let = intern("let");
+	sym_let_star = intern("let*");
+	sym_letrec = intern("letrec");
+	sym_out_of_scope = intern("(out of scope)");
+	sym_while = intern("while");
+	sym_dotimes = intern("dotimes");
 	sym_def = intern("def");
 	sym_const = intern("const");
 	sym_defun = intern("defun");
@@ -2891,6 +6783,7 @@ void um_init() {
 	sym_error_t = intern("@Error");
 	sym_type_t = intern("@Type");
 	sym_bool_t = intern("@Bool");
+	sym_integer_t = intern("@Integer");
 
 #define add_builtin(name, fn_ptr) \
 	env_assign(env, intern(name).value.symbol, new_builtin(fn_ptr))
@@ -2916,6 +6809,8 @@ void um_init() {
 	env_assign(env, sym_error_t.value.symbol, new ((um_NounType)error_t));
 	env_assign(env, sym_type_t.value.symbol, new ((um_NounType)type_t));
 	env_assign(env, sym_bool_t.value.symbol, new ((um_NounType)bool_t));
+	env_assign(
+	    env, sym_integer_t.value.symbol, new ((um_NounType)integer_t));
 
 	add_builtin("car", builtin_car);
 	add_builtin("cdr", builtin_cdr);
@@ -2935,6 +6830,11 @@ void um_init() {
 
 	add_builtin("__builtin_pow", builtin_pow);
 	add_builtin("__builtin_cbrt", builtin_cbrt);
+	add_builtin("__builtin_sum", builtin_sum);
+	add_builtin("__builtin_product", builtin_product);
+	add_builtin("__builtin_min", builtin_min);
+	add_builtin("__builtin_max", builtin_max);
+	add_builtin("__builtin_dot", builtin_dot);
 	add_builtin("not", builtin_not);
 	add_builtin("__builtin_sin", builtin_sin);
 	add_builtin("__builtin_cos", builtin_cos);
@@ -2947,17 +6847,27 @@ void um_init() {
 	add_builtin("type", builtin_type);
 	add_builtin("exit", builtin_exit);
 	add_builtin("apply", builtin_apply);
+	add_builtin("foldl", builtin_foldl);
+	add_builtin("foldr", builtin_foldr);
+	add_builtin("__builtin_append", builtin_append);
+	add_builtin("reduce", builtin_reduce);
+	add_builtin("unary-map", builtin_unary_map);
+	add_builtin("map", builtin_map);
+	add_builtin("filter", builtin_filter);
+	add_builtin("for-each", builtin_for_each);
 	add_builtin("macex", builtin_macex);
 	add_builtin("str", builtin_string);
 	add_builtin("print", builtin_print);
 	add_builtin("pair?", builtin_pairp);
 	add_builtin("float", builtin_float);
+	add_builtin("int", builtin_integer);
 	add_builtin("range", builtin_range);
 	add_builtin("cast", builtin_cast);
 	add_builtin("getlist", builtin_getlist);
 	add_builtin("and", builtin_and);
 	add_builtin("setlist", builtin_setlist);
 	add_builtin("__builtin_vector", builtin_vector);
+	add_builtin("__builtin_table", builtin_table);
 	add_builtin("__builtin_ceil", builtin_ceil);
 	add_builtin("__builtin_floor", builtin_floor);
 	add_builtin("__builtin_format_hex", builtin_hex);
@@ -2978,22 +6888,15 @@ void um_init() {
 	add_builtin("defun", new_builtin(NULL).value.builtin);
 	add_builtin("quote", new_builtin(NULL).value.builtin);
 	add_builtin("lambda", new_builtin(NULL).value.builtin);
+	add_builtin("let", new_builtin(NULL).value.builtin);
+	add_builtin("let*", new_builtin(NULL).value.builtin);
+	add_builtin("letrec", new_builtin(NULL).value.builtin);
+	add_builtin("while", new_builtin(NULL).value.builtin);
+	add_builtin("dotimes", new_builtin(NULL).value.builtin);
 	ingest("\
 (defun compose (f g)\
 	(lambda (x) (f (g x))))");
 
-	ingest("\
-(def (foldl proc init list)\
-	(if !(nil? list)\
-		(foldl proc (proc init (car list)) (cdr list))\
-		init))");
-
-	ingest("\
-(def (foldr p i l)\
-	(if !(nil? l)\
-		(p (car l) (foldr p i (cdr l)))\
-		i))");
-
 	ingest("\
 (def (nil? x)\
 	(= x ()))");
@@ -3002,21 +6905,6 @@ void um_init() {
 (def (list . items)\
 	(foldr cons nil items))");
 
-	ingest("\
-(def (unary-map proc list)\
-	(foldr\
-		(lambda (x rest) (cons (proc x) rest))\
-		nil\
-		list))");
-
-	ingest("\
-(def (map proc . arg-lists)\
-	(if !(nil? (car arg-lists))\
-		(cons\
-			(apply proc (unary-map car arg-lists))\
-			(apply map (cons proc (unary-map cdr arg-lists))))\
-		nil))");
-
 	ingest("\
 (def (caar x)\
 	(car (car x)))");
@@ -3030,97 +6918,62 @@ void um_init() {
 	(list 'if condition () expr))");
 
 	ingest("\
-(def (append a b)\
-	(foldr cons b a))");
+(def append __builtin_append)");
 
 	ingest("\
-(mac quasiquote (x)\
- 	(if (pair? x)\
-  		(if (= (car x) 'unquote)\
-   			(cadr x)\
-    			(if (if (pair? (car x)) (= (caar x) 'unquote-splicing))\
-     				(list 'append (cadr (car x)) (list 'quasiquote (cdr x)))\
-     				(list 'cons (list 'quasiquote (car x)) (list 'quasiquote (cdr x)))))\
-    		(list 'quote x)))");
+(mac namespace (name . defs)\
+	(list 'const name\
+		(cons '__builtin_table\
+			(foldr\
+				(lambda (d rest)\
+					(cons (list 'quote (car d)) (cons (cadr d) rest)))\
+				nil\
+				defs))))");
 
 	ingest("\
-(mac let (defs . body)\
-	`((lambda ,(map car defs) ,@body) ,@(map cadr defs)))");
+(namespace std\
+	(vector __builtin_vector) \
+	(table __builtin_table) \
+	(list list) \
+	(map map) \
+	(cast cast))");
 
 	ingest("\
-(defun std (fun)\
-	(switch fun \
-		('vector __builtin_vector) \
-		('list list) \
-		('map map) \
-		('cast cast)))");
+(namespace format\
+	(hex __builtin_format_hex)\
+	(precision __builtin_format_precision)\
+	(upper __builtin_format_upper)\
+	(lower __builtin_format_lower))");
 
 	ingest("\
-(defun format (fun)\
-	(switch fun\
-		('hex __builtin_format_hex)\
-		('precision __builtin_format_precision)\
-		('upper __builtin_format_upper)\
-		('lower __builtin_format_lower)\
-		))");
-
-	ingest("\
-(defun math (fun)\
-	(switch fun\
-		('pi 3.1415926535897931)\
-		('e 2.7182818284590452)\
-		('ceil __builtin_ceil)\
-		('floor __builtin_floor)\
-		('tan __builtin_tan)\
-		('sin __builtin_sin)\
-		('cos __builtin_cos)\
-		('atan __builtin_atan)\
-		('asin __builtin_asin)\
-		('acos __builtin_acos)\
-		('range range)\
-		('sqrt (lambda (x) (math::pow x (float 0.5))))\
-		('cbrt __builtin_cbrt)\
-		('square (lambda (x) (math::pow x 2)))\
-		('cube (lambda (x) (math::pow x 3)))\
-		('sum (lambda (x) (reduce + x 0)))\
-		('product (lambda (x) (reduce * x 1)))\
-		('sigma (lambda (f s e)\
-			(reduce + (map f (range s e)) 0)))\
-		('min (lambda (x) \
-			(if (nil? (cdr x))\
-				(car x) \
-				(foldl (lambda (a b) (if (< a b) a b)) (car x) (cdr x)))))\
-		('max (lambda (x) \
-			(if (nil? (cdr x))\
-				(car x) \
-				(foldl (lambda (a b) (if (< a b) b a)) (car x) (cdr x)))))\
-		('pow __builtin_pow)))");
-
-	ingest("\
-(def (for-each proc items)\
-  	(if (nil? items)\
-   		_\
-   		(if ((lambda (x) true) (proc (car items))) \
-    			(for-each proc (cdr items)))))");
-
-	ingest("\
-(def (filter pred lst)\
-   	(if (nil? lst)\
-    		()\
-    		(if (pred (car lst))\
-     			(cons (car lst)\
-     			(filter pred (cdr lst)))\
-   	(filter pred (cdr lst)))))");
+(namespace math\
+	(pi 3.1415926535897931)\
+	(e 2.7182818284590452)\
+	(ceil __builtin_ceil)\
+	(floor __builtin_floor)\
+	(tan __builtin_tan)\
+	(sin __builtin_sin)\
+	(cos __builtin_cos)\
+	(atan __builtin_atan)\
+	(asin __builtin_asin)\
+	(acos __builtin_acos)\
+	(range range)\
+	(sqrt (lambda (x) (math::pow x (float 0.5))))\
+	(cbrt __builtin_cbrt)\
+	(square (lambda (x) (math::pow x 2)))\
+	(cube (lambda (x) (math::pow x 3)))\
+	(sum __builtin_sum)\
+	(product __builtin_product)\
+	(dot __builtin_dot)\
+	(sigma (lambda (f s e)\
+		(__builtin_sum (map f (range s e)))))\
+	(min __builtin_min)\
+	(max __builtin_max)\
+	(pow __builtin_pow))");
 
 	ingest("\
 (defun curry (f)\
 	(lambda (a) (lambda (b) (f a b))))");
-
-	ingest("\
-(def (reduce f l id)\
-        (if (nil? l)\
-                id\
-                (f (car l) (reduce f (cdr l) id))))");
 }
 
 #endif